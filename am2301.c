@@ -10,13 +10,93 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <string.h>
+#include <avr/pgmspace.h>
 #include <stdio.h>
 #include "am2301.h"
 #include "timer.h"
+#include "ring_buffer.h"
+#include "i2c.h"
+#include "i2c_bus.h"
+#include "filter.h"
 
 
-am2301_interrupt_data_t interrupt_data;
+/*
+ * Input capture ISR only puts edge timestamps into capture_events ring buffer, and main program collects them
+ * into a capture buffer. Capture buffers are used in ping-pong fashion: one of them is being filled while the other
+ * one holds the previous frame for decoding and formatting. They are swapped in stop_am2301_measurement().
+ * Before the first measurement the decoder has an empty buffer which is reported as "no data".
+ */
+_Static_assert(AM2301_RECORDED_EDGES * sizeof(uint16_t) <= AM2301_EVENT_BUFFER_SIZE, "edge timestamps of a frame must fit into event buffer");
+RING_BUFFER_DEFINE(capture_events, AM2301_EVENT_BUFFER_SIZE);
+volatile uint8_t capture_edges; /* All falling edges of the measurement, counted by ISR */
+volatile uint16_t capture_latency_max; /* Worst ISR entry latency of the measurement, timer ticks */
+
+am2301_interrupt_data_t capture_buffers[AM2301_CAPTURE_BUFFERS] = { \
+    {.data_validity = DATA_INCOMPLETE_DATA},\
+    {.data_validity = DATA_INCOMPLETE_DATA}
+};
+am2301_interrupt_data_t *capture_data = NULL; /* Being filled, NULL when no measurement is running */
+am2301_interrupt_data_t *decoded_data = &capture_buffers[1];
+am2301_error_counters_t error_counters;
+uint32_t first_valid_sample_time = 0;
+
+/* Valid samples go through these, filtered values are kept in AM2301 format */
+filter_t humidity_filter = {.ema_shift = FILTER_EMA_SHIFT};
+filter_t temperature_filter = {.ema_shift = FILTER_EMA_SHIFT};
+uint16_t filtered_humidity;
+uint16_t filtered_temperature;
+
+am2301_measurement_state_t measurement_state = AM2301_IDLE;
+uint32_t measurement_deadline;
+
+/*
+ * Timer1 runs in CTC mode, so time between two timer values must take wrapping at OCR_LIMIT into account.
+ *
+ */
+static inline uint16_t am2301_tick_difference(uint16_t earlier, uint16_t later)
+{
+    if (later >= earlier)
+    {
+        /* timer has not wrapped */
+        return later - earlier;
+    }
+    /* timer has wrapped */
+    return OCR_LIMIT - (earlier - later);
+}
+
+/*
+ * AM2301 temperature is sign and magnitude: MSB set means negative. Filter needs two's complement.
+ *
+ */
+static inline int16_t am2301_temperature_to_signed(uint16_t temperature)
+{
+    if (temperature & 0x8000)
+    {
+        return -(int16_t)(temperature & 0x7fff);
+    }
+    return (int16_t)temperature;
+}
+
+static inline uint16_t am2301_temperature_from_signed(int16_t temperature)
+{
+    if (temperature < 0)
+    {
+        return 0x8000 | (uint16_t)(-temperature);
+    }
+    return (uint16_t)temperature;
+}
+
+/*
+ * Run a valid sample through median and EMA filters.
+ *
+ */
+void filter_am2301_sample(const am2301_interrupt_data_t *data)
+{
+    filtered_humidity = filter_update(&humidity_filter, data->humidity_int);
+    filtered_temperature = am2301_temperature_from_signed(filter_update(&temperature_filter,
+                                                           am2301_temperature_to_signed(data->temperature_int)));
+    return;
+}
 
 void set_am2301_pin_output(uint8_t signal_state)
 {
@@ -53,49 +133,133 @@ void disable_am2301_input_capture_interrupt()
 }
 
 /*
- * Make a dummy measurement request (data is not received) to wake up AM2301. Usually AM2301 gives only trash data
- * from first measurement, but later ones are successful.
+ * Move edge timestamps from ISR into capture buffer. Bit lengths (from falling edge to next falling edge)
+ * are calculated from previous timestamp and current one.
+ *
+ * Two first falling edges are discarded, because they are not "databits", but "handshaking bits".
+ * bitcounter counts collected edges here, stop_am2301_measurement() replaces it with the count of all edges.
  *
  */
-void initial_am2301_wakeup()
+void collect_am2301_edges(am2301_interrupt_data_t *data)
 {
-    uint32_t delay_loop;
-    set_am2301_pin_output(0); /* Atmel recommendation not to go directly from tri-state to output high */
-    set_am2301_pin_output(1);
-    for (delay_loop = 0; delay_loop < 20000; delay_loop++);
-    set_am2301_pin_output(0);
-    for (delay_loop = 0; delay_loop < 20000; delay_loop++);
-    set_am2301_pin_output(1);
-    
+    uint16_t timestamp, period;
+
+    while (ring_buffer_read(&capture_events, (uint8_t *)&timestamp, sizeof(timestamp)))
+    {
+        data->bitcounter++;
+        if (data->bitcounter < 3)
+        {
+            if (data->bitcounter == 1)
+            {
+                data->first_edge_timestamp = timestamp;
+            }
+        }
+        else
+        {
+            period = am2301_tick_difference(data->last_timestamp, timestamp) / AM2301_TICKS_PER_BIT_PERIOD_UNIT;
+            data->bit_periods[data->bitcounter - 3] = (period > 0xff) ? 0xff : period;
+        }
+        data->last_timestamp = timestamp;
+    }
     return;
 }
 
+/*
+ * Stop AM2301 measurement and hand the captured frame over to the decoder. Capture interrupt is disabled first,
+ * so no more edges arrive after the last ones have been collected. I2C bus is released for display updates.
+ *
+ */
 void stop_am2301_measurement()
 {
     set_am2301_pin_output(0);
     set_am2301_pin_output(1);
     disable_am2301_input_capture_interrupt();
+    measurement_state = AM2301_IDLE;
     
+    if (capture_data != NULL)
+    {
+        collect_am2301_edges(capture_data);
+        capture_data->bitcounter = capture_edges;
+        capture_data->capture_latency_max = capture_latency_max;
+        decoded_data = capture_data;
+        capture_data = NULL;
+    }
+    i2c_bus_release();
     return;
 }
 
 /*
- * Start AM2301 measurement by pulling data line low for some time, then pulling it back to high, and finally configure
- * pin as input. Initialise the data structure and enable input capture interrupt from timer
+ * Start AM2301 measurement by pulling data line low. Measurement continues in am2301_measurement_ready(),
+ * which releases the line after the start pulse, captures the frame and finally stops the measurement.
+ *
+ * Capture goes into the buffer which is not used by the decoder, so the previous frame stays intact.
+ * Only the header needs to be reset: bit_periods[] are written in order and bitcounter tells how many are valid.
+ *
+ * I2C bus is held from here until the frame has been captured, so TWI interrupts cannot delay capture interrupts.
+ * Transfer which is on the bus now is completed well within the start pulse.
  *
  */
 void start_am2301_measurement()
 {
-    uint32_t stop;
-    memset(&interrupt_data, 0, sizeof(interrupt_data));
+    am2301_interrupt_data_t *buffer;
+    
+    buffer = (decoded_data == &capture_buffers[0]) ? &capture_buffers[1] : &capture_buffers[0];
+    buffer->bitcounter = 0;
+    buffer->last_timestamp = 0;
+    buffer->zero_bit_limit = 180;
+    buffer->data_validity = DATA_INCOMPLETE_DATA;
+    capture_data = buffer;
+    /* Capture interrupt is still disabled, so consumer may also reset the edge counter */
+    ring_buffer_discard(&capture_events);
+    capture_edges = 0;
+    capture_latency_max = 0;
+    
     set_am2301_pin_output(0);
-    for (stop = 0; stop < 20000; stop++);
-    set_am2301_pin_input();
-    enable_am2301_input_capture_interrupt();
-    interrupt_data.zero_bit_limit = 180;
+    measurement_deadline = get_microseconds() + AM2301_START_PULSE_US;
+    i2c_bus_hold(measurement_deadline + AM2301_START_PULSE_SLACK_US + AM2301_CAPTURE_WINDOW_US);
+    measurement_state = AM2301_START_PULSE;
     return;
 }
 
+/*
+ * Advance the measurement started by start_am2301_measurement(). This does not block, call it until it
+ * returns non-zero: then the frame has been handed over and it can be processed.
+ *
+ * Deadlines are checked only when this is called, so when caller sleeps between calls, start pulse may be up
+ * to one systick (10ms) longer. AM2301 accepts start pulses up to 20ms.
+ *
+ */
+uint8_t am2301_measurement_ready()
+{
+    switch (measurement_state)
+    {
+        case    AM2301_START_PULSE:
+                if (timer_expired(measurement_deadline))
+                {
+                    set_am2301_pin_input();
+                    capture_data->release_timestamp = TCNT1;
+                    enable_am2301_input_capture_interrupt();
+                    measurement_deadline = get_microseconds() + AM2301_CAPTURE_WINDOW_US;
+                    i2c_bus_hold(measurement_deadline);
+                    measurement_state = AM2301_CAPTURING;
+                }
+                return 0;
+        
+        case    AM2301_CAPTURING:
+                if (timer_expired(measurement_deadline))
+                {
+                    stop_am2301_measurement();
+                    return 1;
+                }
+                collect_am2301_edges(capture_data);
+                return 0;
+        
+        default:
+                /* Nothing ongoing */
+                return 1;
+    }
+}
+
 /*
  * Timer input capture interrupt, this is called when "input signal change" is
  * detected, and "timestamp" is automatically saved by HW to be read later - here in ISR.
@@ -105,73 +269,103 @@ void start_am2301_measurement()
  * at periods less than 85us (zero bits) and more than 116us (one bits). Difference is more than 30us - far more than
  * typical interrupt latency, e.g. if using pin change interrupts.
  * 
- * ISR keeps count on how many falling edges are detected, lengths of bits (from falling edge to next falling edge)
- * are calculated from previous time stamp and current one.
+ * ISR latency (timer value at ISR entry minus captured timestamp) does not affect measured bit times, but it
+ * tells how close other interrupts come to delaying capture, so the worst one of each frame is recorded.
  *
- * Two first falling edges are discarded, because they are not "databits", but "handshaking bits".
- * Actual "bit lengths" are stored into array until all 40 bits are received - remainder of bits are discarded.
+ * ISR counts all falling edges, and puts timestamps of the edges carrying handshaking and data bits into
+ * capture_events, from where they are collected by main program. Remainder of edges are only counted.
  * For some reason, this AM2301 sends 65 databits for some reason - extra bits are zeroes...
  *
  */
 ISR(TIMER1_CAPT_vect)
 {
-    register uint16_t timestamp, time_difference;
-
-    interrupt_data.bitcounter++;
+    uint16_t counter = TCNT1; /* First, so latency is measured at ISR entry */
+    uint16_t timestamp = ICR1;
+    uint16_t latency;
+    uint8_t edges = capture_edges;
 
-    /* There is two unnecessary "falling edges" at beginning, discard them */
-    if (interrupt_data.bitcounter < 3)
-    {
-        interrupt_data.last_timestamp = ICR1;
-        return;
-    }
-    if (interrupt_data.bitcounter > 42)
+    latency = am2301_tick_difference(timestamp, counter);
+    if (latency > capture_latency_max)
     {
-        return;
+        capture_latency_max = latency;
     }
 
-    /* Now handle rest of bits */
-    timestamp = ICR1;
-
-    if (timestamp > interrupt_data.last_timestamp)
+    if (edges < 0xff)
     {
-        /* timer has not wrapped */
-        time_difference = timestamp - interrupt_data.last_timestamp;
+        /* Extra edges are counted too, but counter must not wrap back into data bits */
+        edges++;
+        capture_edges = edges;
     }
-    else
+    if (edges <= AM2301_RECORDED_EDGES)
     {
-        /* timer has wrapped */
-        time_difference = 20000 - (interrupt_data.last_timestamp - timestamp);
+        ring_buffer_write(&capture_events, (const uint8_t *)&timestamp, sizeof(timestamp));
     }
-    interrupt_data.last_timestamp = timestamp;
-    interrupt_data.timestamps[interrupt_data.bitcounter -3] = time_difference;
     return;
 }
 
+/*
+ * Convert one bit period into a bit value, and update link quality statistics of the frame at the same time.
+ * Statistics are kept in timer ticks, like zero_bit_limit.
+ *
+ */
+uint8_t decode_am2301_bit(am2301_interrupt_data_t *data, uint8_t bit_period)
+{
+    am2301_link_quality_t *quality = &data->link_quality;
+    uint16_t bit_time = (uint16_t)bit_period * AM2301_TICKS_PER_BIT_PERIOD_UNIT;
+    
+    if (bit_time > data->zero_bit_limit)
+    {
+        /* Bit is longer than zero bit time -> it is '1' */
+        if (bit_time < quality->one_min) quality->one_min = bit_time;
+        if (bit_time > quality->one_max) quality->one_max = bit_time;
+        return 1;
+    }
+    /* Bit time is shorter than zero bit time -> it is '0' */
+    if (bit_time < quality->zero_min) quality->zero_min = bit_time;
+    if (bit_time > quality->zero_max) quality->zero_max = bit_time;
+    return 0;
+}
+
 void calculate_am2301_data(am2301_interrupt_data_t *data)
 {
     uint8_t i, parity, temp_parity;
     uint16_t conversion;
+    am2301_link_quality_t *quality = &data->link_quality;
+    
+    quality->edge_count = data->bitcounter;
+    quality->response_latency = 0;
+    quality->zero_min = 0xffff;
+    quality->zero_max = 0;
+    quality->one_min = 0xffff;
+    quality->one_max = 0;
+    quality->zero_margin = AM2301_NO_MARGIN;
+    quality->one_margin = AM2301_NO_MARGIN;
+    quality->capture_latency_max = data->capture_latency_max;
+    error_counters.frames++;
+    
+    if (data->bitcounter > 0)
+    {
+        quality->response_latency = am2301_tick_difference(data->release_timestamp, data->first_edge_timestamp);
+    }
+    else
+    {
+        /* AM2301 did not pull the data line at all */
+        error_counters.no_response++;
+        data->data_validity = DATA_INCOMPLETE_DATA;
+        return;
+    }
     
     /* Very first, checking - is there enough databits? If not, then the AM2301 may not have responded properly */
     if (data->bitcounter < 43)
     {
+        error_counters.incomplete++;
         data->data_validity = DATA_INCOMPLETE_DATA;
         return;
     }
     conversion = 0;
     for(i = 0; i < 16; i++)
     {
-        if (data->timestamps[i] > data->zero_bit_limit)
-        {
-            /* Bit is longer than zero bit time -> it is '1' */
-            conversion = (conversion << 1) | 1;
-        }
-        else
-        {
-            /* Bit time is shorter than zero bit time -> it is '0' */
-            conversion = conversion << 1;
-        }
+        conversion = (conversion << 1) | decode_am2301_bit(data, data->bit_periods[i]);
     }
     data->humidity_int = conversion;
     
@@ -179,16 +373,7 @@ void calculate_am2301_data(am2301_interrupt_data_t *data)
     
     for (i = 16; i < 32; i++)
     {
-        if (data->timestamps[i] > data->zero_bit_limit)
-        {
-            /* Bit is longer than zero bit time -> it is '1' */
-            conversion = (conversion << 1) | 1;
-        }
-        else
-        {
-            /* Bit time is shorter than zero bit time -> it is '0' */
-            conversion = conversion << 1;
-        }
+        conversion = (conversion << 1) | decode_am2301_bit(data, data->bit_periods[i]);
     }
     data->temperature_int = conversion;
     
@@ -196,18 +381,18 @@ void calculate_am2301_data(am2301_interrupt_data_t *data)
     
     for (i = 32; i < 40; i++)
     {
-        if (data->timestamps[i] > data->zero_bit_limit)
-        {
-            /* Bit is longer than zero bit time -> it is '1' */
-            conversion = (conversion << 1) | 1;
-        }
-        else
-        {
-            /* Bit time is shorter than zero bit time -> it is '0' */
-            conversion = conversion << 1;
-        }
+        parity = (parity << 1) | decode_am2301_bit(data, data->bit_periods[i]);
+    }
+    
+    /* Margins tell how close the worst bits were to being misinterpreted */
+    if (quality->zero_max > 0)
+    {
+        quality->zero_margin = data->zero_bit_limit - quality->zero_max;
+    }
+    if (quality->one_max > 0)
+    {
+        quality->one_margin = quality->one_min - data->zero_bit_limit;
     }
-    return;
     
     /* Calculate parity: It is 8lowmost bits of sum of all 4 databytes */
     
@@ -215,60 +400,140 @@ void calculate_am2301_data(am2301_interrupt_data_t *data)
     if (temp_parity == parity)
     {
         data->data_validity = DATA_VALID;
+        error_counters.valid++;
+        filter_am2301_sample(data);
+        if (first_valid_sample_time == 0)
+        {
+            first_valid_sample_time = get_microseconds();
+        }
     }
     else
     {
         data->data_validity = DATA_PARITY_ERROR;
+        error_counters.parity_errors++;
     }
-    
-    
+    return;
+}
+
+/*
+ * Decode the latest frame handed over by stop_am2301_measurement(). This is done only once per frame,
+ * formatting functions below use the decoded values.
+ *
+ */
+void process_am2301_measurement()
+{
+    calculate_am2301_data(decoded_data);
+    return;
 }
+
+/*
+ * Display strings show filtered values, while validity is that of the latest frame.
+ *
+ */
 void get_am2301_temperature(char *ptr, uint8_t maxlen)
 {
-    calculate_am2301_data(&interrupt_data);
-    
-    switch (interrupt_data.data_validity)
+    switch (decoded_data->data_validity)
     {
         case    DATA_VALID:
                 /* Temperature may be negative, this is indicated by the MSB set '1' */
-                if ((interrupt_data.temperature_int & 0x8000) == 0x8000)
+                if ((filtered_temperature & 0x8000) == 0x8000)
                 {
                     /* Negative temperature, make it negative by using negative divider */
-                    snprintf(ptr, maxlen, "Temp: %.1f %c%c   ", (float)(interrupt_data.temperature_int & 0x7fff)/-10.0, 0xdf, 0x43);
+                    snprintf_P(ptr, maxlen, PSTR("Temp: %.1f %c%c   "), (float)(filtered_temperature & 0x7fff)/-10.0, 0xdf, 0x43);
                 }
                 else
                 {
                     /* Positive temperature */
-                    snprintf(ptr, maxlen, "Temp: %.1f %c%c  ", (float)(interrupt_data.temperature_int)/10.0, 0xdf, 0x43);
+                    snprintf_P(ptr, maxlen, PSTR("Temp: %.1f %c%c  "), (float)(filtered_temperature)/10.0, 0xdf, 0x43);
                 }                    
                 break;
                 
         case    DATA_PARITY_ERROR:
-                snprintf(ptr, maxlen, "Temp: <parity>");
+                snprintf_P(ptr, maxlen, PSTR("Temp: <parity>"));
                 break;
                 
         default:
-                snprintf(ptr, maxlen, "Temp: <no data>");
+                snprintf_P(ptr, maxlen, PSTR("Temp: <no data>"));
                 break;
     }
     return;
 }
 
+/*
+ * Latest decoded values in AM2301 format, 0,1 units.
+ *
+ */
+void get_am2301_sample(am2301_sample_t *sample)
+{
+    sample->humidity_int = decoded_data->humidity_int;
+    sample->temperature_int = decoded_data->temperature_int;
+    sample->data_validity = decoded_data->data_validity;
+    return;
+}
+
+/*
+ * Filtered values in AM2301 format. Validity is that of the latest frame, values are from valid frames only.
+ *
+ */
+void get_am2301_filtered_sample(am2301_sample_t *sample)
+{
+    sample->humidity_int = filtered_humidity;
+    sample->temperature_int = filtered_temperature;
+    sample->data_validity = decoded_data->data_validity;
+    return;
+}
+
+/*
+ * EMA time constant of both filters, about 2^shift samples. Zero leaves only median filtering.
+ *
+ */
+void set_am2301_filter_shift(uint8_t shift)
+{
+    filter_set_ema_shift(&humidity_filter, shift);
+    filter_set_ema_shift(&temperature_filter, shift);
+    return;
+}
+
+/*
+ * Link quality of the latest decoded frame. All times are timer ticks, i.e. 0,5us.
+ *
+ */
+void get_am2301_link_quality(am2301_link_quality_t *quality)
+{
+    *quality = decoded_data->link_quality;
+    return;
+}
+
+void get_am2301_error_counters(am2301_error_counters_t *counters)
+{
+    *counters = error_counters;
+    return;
+}
+
+/*
+ * Boot to first valid sample time in microseconds, i.e. time from init_timer() until a frame with valid parity
+ * was decoded. Zero if there has not been any valid sample yet.
+ *
+ */
+uint32_t get_am2301_first_valid_time(void)
+{
+    return first_valid_sample_time;
+}
+
 void get_am2301_humidity(char *ptr, uint8_t maxlen)
 {
-    calculate_am2301_data(&interrupt_data);
-    switch (interrupt_data.data_validity)
+    switch (decoded_data->data_validity)
     {
         case    DATA_VALID:
-                snprintf(ptr, maxlen, "Hum : %.1f %s   ", (interrupt_data.humidity_int)/10.0, "%");
+                snprintf_P(ptr, maxlen, PSTR("Hum : %.1f %%   "), (filtered_humidity)/10.0);
                 break;
         
         case    DATA_PARITY_ERROR:
-                snprintf(ptr, maxlen, "Hum : <parity>");
+                snprintf_P(ptr, maxlen, PSTR("Hum : <parity>"));
                 break;
         
         default:
-                snprintf(ptr, maxlen, "Hum : <no data>");
+                snprintf_P(ptr, maxlen, PSTR("Hum : <no data>"));
                 break;
     }
     return;
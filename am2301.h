@@ -9,9 +9,51 @@
 #define AM2301_H_
 
 #define TIMESTAMPS 40
+#define AM2301_CAPTURE_BUFFERS 2
+#define AM2301_RECORDED_EDGES (TIMESTAMPS + 2) /* Two handshaking edges and data bits */
+#define AM2301_EVENT_BUFFER_SIZE 128 /* Edge timestamps from ISR, bytes */
 #define DATA_VALID 0
 #define DATA_PARITY_ERROR 1
 #define DATA_INCOMPLETE_DATA 2
+#define AM2301_START_PULSE_US 2000 /* Data line low time to request a measurement, AM2301 accepts 0,8-20ms */
+#define AM2301_CAPTURE_WINDOW_US 20000 /* Whole frame fits into this after releasing data line */
+#define AM2301_START_PULSE_SLACK_US 10000 /* Start pulse may end one systick late, see am2301_measurement_ready() */
+#define AM2301_TICKS_PER_BIT_PERIOD_UNIT 2 /* bit_periods[] are stored in 1us units to halve their size */
+#define AM2301_NO_MARGIN 0xffff /* Margin is not known, because frame had no bits of that kind */
+
+/*
+ * Link quality statistics of one frame. Times are in timer ticks (0,5us).
+ * Margins are distances of the worst '0' and '1' bits from zero_bit_limit.
+ */
+typedef struct
+{
+    uint16_t zero_min;
+    uint16_t zero_max;
+    uint16_t one_min;
+    uint16_t one_max;
+    uint16_t zero_margin;
+    uint16_t one_margin;
+    uint16_t response_latency; /* From releasing data line to first falling edge from AM2301 */
+    uint8_t edge_count; /* All falling edges, including handshaking and extra bits */
+    uint16_t capture_latency_max; /* Worst input capture interrupt latency, from edge to ISR entry */
+} am2301_link_quality_t;
+
+typedef struct
+{
+    uint16_t humidity_int;
+    uint16_t temperature_int; /* MSB set means negative temperature */
+    uint8_t data_validity;
+} am2301_sample_t;
+
+/* Cumulative outcome counters of all decoded frames */
+typedef struct
+{
+    uint16_t frames;
+    uint16_t valid;
+    uint16_t parity_errors;
+    uint16_t incomplete;
+    uint16_t no_response;
+} am2301_error_counters_t;
 
 typedef struct
 {
@@ -20,15 +62,31 @@ typedef struct
     uint16_t humidity_int;
     uint16_t temperature_int;
     uint16_t last_timestamp;
-    uint8_t parity;
+    uint16_t release_timestamp;
+    uint16_t first_edge_timestamp;
+    uint16_t capture_latency_max;
     uint8_t data_validity;
-    uint16_t timestamps[TIMESTAMPS];
-    uint16_t abs_time[TIMESTAMPS];
+    uint8_t bit_periods[TIMESTAMPS]; /* Microseconds, saturated at 255 */
+    am2301_link_quality_t link_quality;
 } am2301_interrupt_data_t;
 
-void initial_am2301_wakeup();
+typedef enum
+{
+    AM2301_IDLE = 0,
+    AM2301_START_PULSE,
+    AM2301_CAPTURING
+} am2301_measurement_state_t;
+
 void stop_am2301_measurement();
 void start_am2301_measurement();
+uint8_t am2301_measurement_ready();
+void process_am2301_measurement();
 void get_am2301_temperature(char *, uint8_t);
 void get_am2301_humidity(char *, uint8_t);
+void get_am2301_sample(am2301_sample_t *);
+void get_am2301_filtered_sample(am2301_sample_t *);
+void set_am2301_filter_shift(uint8_t);
+void get_am2301_link_quality(am2301_link_quality_t *);
+void get_am2301_error_counters(am2301_error_counters_t *);
+uint32_t get_am2301_first_valid_time(void);
 #endif /* AM2301_H_ */
\ No newline at end of file
@@ -0,0 +1,100 @@
+/*
+ * filter.c
+ *
+ *
+ * Median and exponential moving average filter, see filter.h.
+ */
+
+#include <avr/io.h>
+
+#include "filter.h"
+
+_Static_assert((FILTER_MEDIAN_LENGTH & 1) && (FILTER_MEDIAN_LENGTH <= 7), "median length must be odd, 1-7");
+_Static_assert(FILTER_EMA_SHIFT <= FILTER_EMA_MAX_SHIFT, "EMA shift too large");
+
+void filter_init(filter_t *filter, uint8_t ema_shift)
+{
+    filter->position = 0;
+    filter->primed = 0;
+    filter->average = 0;
+    filter_set_ema_shift(filter, ema_shift);
+    return;
+}
+
+void filter_set_ema_shift(filter_t *filter, uint8_t ema_shift)
+{
+    filter->ema_shift = (ema_shift > FILTER_EMA_MAX_SHIFT) ? FILTER_EMA_MAX_SHIFT : ema_shift;
+    return;
+}
+
+/*
+ * Value is the median when less than half of the values are below it, and less than half are above it.
+ * Checking each value against the others is fast enough for a few values, and needs no sorted copy.
+ *
+ */
+int16_t filter_median(const int16_t *values)
+{
+    uint8_t i, j, below, equal;
+
+    for (i = 0; i < FILTER_MEDIAN_LENGTH; i++)
+    {
+        below = 0;
+        equal = 0;
+        for (j = 0; j < FILTER_MEDIAN_LENGTH; j++)
+        {
+            if (values[j] < values[i])
+            {
+                below++;
+            }
+            else if (values[j] == values[i])
+            {
+                equal++;
+            }
+        }
+        if ((below <= FILTER_MEDIAN_LENGTH / 2) && ((below + equal) > FILTER_MEDIAN_LENGTH / 2))
+        {
+            return values[i];
+        }
+    }
+    return values[0]; /* Not reached */
+}
+
+/*
+ * Add a sample and return filtered value. First sample fills the whole history, so output starts from it
+ * instead of ramping up from zero.
+ *
+ */
+int16_t filter_update(filter_t *filter, int16_t value)
+{
+    uint8_t i;
+    int16_t median;
+
+    if (!filter->primed)
+    {
+        for (i = 0; i < FILTER_MEDIAN_LENGTH; i++)
+        {
+            filter->history[i] = value;
+        }
+        filter->average = (int32_t)value << FILTER_EMA_FRACTION_BITS;
+        filter->primed = 1;
+        return value;
+    }
+    filter->history[filter->position] = value;
+    filter->position++;
+    if (filter->position >= FILTER_MEDIAN_LENGTH)
+    {
+        filter->position = 0;
+    }
+    median = filter_median(filter->history);
+    filter->average += (((int32_t)median << FILTER_EMA_FRACTION_BITS) - filter->average) >> filter->ema_shift;
+    return filter_output(filter);
+}
+
+/*
+ * Latest filtered value, rounded to nearest.
+ *
+ */
+int16_t filter_output(const filter_t *filter)
+{
+    return (filter->average + (1 << (FILTER_EMA_FRACTION_BITS - 1))) >> FILTER_EMA_FRACTION_BITS;
+}
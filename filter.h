@@ -0,0 +1,40 @@
+/*
+ * filter.h
+ *
+ *
+ * Integer filter for slowly changing readings: median of the latest FILTER_MEDIAN_LENGTH samples rejects single
+ * spikes, and exponential moving average after it smooths the rest. No floating point is used, and cost per
+ * sample is constant (median length is fixed at compile time).
+ *
+ * EMA: average += (median - average) / 2^ema_shift, so time constant is about 2^ema_shift samples. Shift 0 turns
+ * averaging off. Average is kept with FILTER_EMA_FRACTION_BITS extra bits, so small steps are not lost to rounding.
+ */
+
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#ifndef FILTER_MEDIAN_LENGTH
+#define FILTER_MEDIAN_LENGTH 3
+#endif
+#ifndef FILTER_EMA_SHIFT
+#define FILTER_EMA_SHIFT 2
+#endif
+#define FILTER_EMA_MAX_SHIFT 7
+#define FILTER_EMA_FRACTION_BITS 4
+
+typedef struct
+{
+    int16_t history[FILTER_MEDIAN_LENGTH];
+    uint8_t position; /* Oldest sample in history */
+    uint8_t primed; /* Zero until first sample */
+    uint8_t ema_shift;
+    int32_t average; /* Scaled by 2^FILTER_EMA_FRACTION_BITS */
+} filter_t;
+
+void filter_init(filter_t *filter, uint8_t ema_shift);
+void filter_set_ema_shift(filter_t *filter, uint8_t ema_shift);
+int16_t filter_update(filter_t *filter, int16_t value);
+int16_t filter_output(const filter_t *filter);
+
+#endif /* FILTER_H_ */
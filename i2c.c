@@ -9,27 +9,116 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include "i2c.h"
+#include "ring_buffer.h"
+#include "timer.h"
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+/*
+ * SCL frequency is F_CPU / (16 + 2 * TWBR * prescaler). Divider TWBR * prescaler is rounded up, so the bus never
+ * runs faster than requested, and the smallest prescaler which keeps TWBR within 8 bits is used.
+ *
+ */
+#define TWI_DIVIDER(rate) ((((F_CPU) + (rate) - 1) / (rate) - 16 + 1) / 2)
+#define TWI_PRESCALER_BITS(rate) ((TWI_DIVIDER(rate) <= 255) ? 0 : \
+                                  (TWI_DIVIDER(rate) <= 4 * 255) ? 1 : \
+                                  (TWI_DIVIDER(rate) <= 16 * 255) ? 2 : 3)
+#define TWI_PRESCALER(rate) (1UL << (2 * TWI_PRESCALER_BITS(rate)))
+#define TWI_TWBR(rate) ((TWI_DIVIDER(rate) + TWI_PRESCALER(rate) - 1) / TWI_PRESCALER(rate))
+#define TWI_ACTUAL_RATE(rate) ((F_CPU) / (16 + 2 * TWI_TWBR(rate) * TWI_PRESCALER(rate)))
+
+_Static_assert(TWI_BIT_RATE <= TWI_FAST_MODE_RATE, "TWI_BIT_RATE is above I2C fast mode");
+_Static_assert((F_CPU) >= 16 * (TWI_BIT_RATE), "F_CPU is too slow for TWI_BIT_RATE");
+_Static_assert(TWI_TWBR(TWI_BIT_RATE) <= 255, "TWI_BIT_RATE is too slow for F_CPU");
+_Static_assert(TWI_ACTUAL_RATE(TWI_BIT_RATE) <= TWI_BIT_RATE, "TWI runs faster than TWI_BIT_RATE");
+_Static_assert(TWI_ACTUAL_RATE(TWI_BIT_RATE) >= TWI_BIT_RATE * 9 / 10, "TWI_BIT_RATE cannot be reached within 10%");
+_Static_assert(TWI_TWBR(TWI_FALLBACK_RATE) <= 255, "TWI_FALLBACK_RATE is too slow for F_CPU");
 
-uint8_t i2c_byte = 0;
 twi_i2c_state_t i2c_state;
+twi_error_counters_t twi_error_counters; /* Updated by ISR, except timeouts and recoveries */
+uint32_t twi_deadline;
+
+/* Status of each finished transfer, from ISR to main program. Only one transfer is on the bus at a time. */
+RING_BUFFER_DEFINE(twi_completions, TWI_COMPLETION_BUFFER_SIZE);
 
+/*
+ * Transfer failed (e.g. slave did not acknowledge its address): release the bus and report error to upper layer.
+ * STOP releases the bus, and also resets TWI after a bus error. After arbitration loss another master owns
+ * the bus, so it is released without STOP.
+ *
+ */
 void twi_error(uint8_t errorcode)
 {
-    
-    i2c_state.status = errorcode;
+    switch (errorcode)
+    {
+        case    TWI_MSS_DATA_TRANSMITTED_ARBITRATION_LOST:
+                TWCR = (1 << TWINT) | (1 << TWEN);
+                twi_error_counters.arbitration_lost++;
+                break;
+
+        case    TWI_MSS_SLA_W_TRANSMITTED_NO_ACK_RECEIVED:
+        case    TWI_MSS_DATA_TRANMITTED_NO_ACK_RECEIVED:
+                TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+                twi_error_counters.nacks++;
+                break;
+
+        default:
+                if (errorcode == TWI_BUS_ERROR)
+                {
+                    errorcode = TWI_STATUS_BUS_ERROR;
+                }
+                TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+                twi_error_counters.bus_errors++;
+                break;
+    }
+    i2c_state.state = WR_ERROR;
+    ring_buffer_put(&twi_completions, errorcode);
+    return;
+}
+
+/*
+ * Transfer sent successfully, STOP is requested here too.
+ *
+ */
+void twi_complete(void)
+{
+    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+    i2c_state.state = WR_STOP_SENDING;
+    ring_buffer_put(&twi_completions, 0);
     return;
 }
 
 void init_twi()
 {
-    /* Let's assume we are using 16MHz clock, set TWI bit rate close to 100kbit/s */
-    /* means that 2*TWBR*prescaler should be 160-16 -> prescaler = 1 and TWBR=72 */
-    
-    TWBR = 72;
-    TWSR = TWSR & 0xFC;
+    twi_select_rate(TWI_RATE_DEFAULT);
     TWCR = (1 << TWIE);
+    i2c_state.state = WR_STOP_SENDING; /* Nothing ongoing */
+    ring_buffer_discard(&twi_completions);
+    return;
+}
+
+/*
+ * Set bit rate for following transfers, e.g. per device. Do not call this while a transfer is ongoing.
+ * At 16MHz TWI_STANDARD_MODE_RATE gives TWBR = 72 and TWI_FAST_MODE_RATE TWBR = 12, both with prescaler 1.
+ *
+ */
+void twi_select_rate(twi_rate_t rate)
+{
+    if (rate == TWI_RATE_FALLBACK)
+    {
+        TWBR = TWI_TWBR(TWI_FALLBACK_RATE);
+        TWSR = (TWSR & 0xFC) | TWI_PRESCALER_BITS(TWI_FALLBACK_RATE);
+    }
+    else
+    {
+        TWBR = TWI_TWBR(TWI_BIT_RATE);
+        TWSR = (TWSR & 0xFC) | TWI_PRESCALER_BITS(TWI_BIT_RATE);
+    }
     return;
 }
 
@@ -39,13 +128,99 @@ void twi_send_command(uint8_t address, uint8_t length, uint8_t *data)
     i2c_state.data_length = length;
     i2c_state.data_ptr = data;
     i2c_state.state = WR_START_SENDING;
+    twi_deadline = get_microseconds() + TWI_TRANSFER_TIMEOUT_US;
     TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWIE) | (1 << TWEN);
     return;
 }
 
-void poll_for_twi_transmitted()
+/*
+ * Free the bus after a transfer got stuck, e.g. a slave was disturbed in the middle of a byte and holds SDA low.
+ *
+ * TWI is disabled, so the pins are ordinary port pins, and the lines are driven like open drain outputs by switching
+ * between output low and input. SCL is clocked until the slave releases SDA, then START and STOP are generated,
+ * which resets slave state machines. Finally TWI is initialised again.
+ *
+ */
+void twi_recover_bus(void)
 {
-    while ((i2c_state.state != WR_STOP_SENDING));
+    uint8_t i;
+
+    TWCR = 0;
+    PORTC &= ~((1 << TWI_SDA_PIN) | (1 << TWI_SCL_PIN)); /* Output low when direction is output */
+    DDRC &= ~((1 << TWI_SDA_PIN) | (1 << TWI_SCL_PIN));
+    delay_microseconds(TWI_RECOVERY_HALF_PERIOD_US);
+    for (i = 0; (i < TWI_RECOVERY_CLOCKS) && !(PINC & (1 << TWI_SDA_PIN)); i++)
+    {
+        DDRC |= (1 << TWI_SCL_PIN);
+        delay_microseconds(TWI_RECOVERY_HALF_PERIOD_US);
+        DDRC &= ~(1 << TWI_SCL_PIN);
+        delay_microseconds(TWI_RECOVERY_HALF_PERIOD_US);
+    }
+    if (!(PINC & (1 << TWI_SDA_PIN)))
+    {
+        twi_error_counters.stuck_bus++;
+    }
+    /* SDA falling while SCL is high is START, and rising is STOP */
+    DDRC |= (1 << TWI_SDA_PIN);
+    delay_microseconds(TWI_RECOVERY_HALF_PERIOD_US);
+    DDRC &= ~(1 << TWI_SDA_PIN);
+    delay_microseconds(TWI_RECOVERY_HALF_PERIOD_US);
+
+    twi_error_counters.recoveries++;
+    init_twi();
+    return;
+}
+
+/*
+ * Transfer is complete when it has either been sent successfully, or it has failed. Returns zero if
+ * no transfer has completed since last call, otherwise status is written as in poll_for_twi_transmitted().
+ *
+ * A transfer which has not completed by its deadline is aborted, and the bus is recovered.
+ *
+ */
+uint8_t twi_get_completion(uint8_t *status)
+{
+    twi_i2c_isr_states_t state;
+
+    if (ring_buffer_get(&twi_completions, status))
+    {
+        return 1;
+    }
+    state = i2c_state.state;
+    if (((state != WR_START_SENDING) && (state != WR_SLA_SENDING) && (state != WR_DATA_SENDING)) || !timer_expired(twi_deadline))
+    {
+        return 0;
+    }
+    TWCR = 0; /* No more TWI interrupts */
+    if (!ring_buffer_get(&twi_completions, status))
+    {
+        /* Not even a late completion */
+        twi_error_counters.timeouts++;
+        *status = TWI_STATUS_TIMEOUT;
+    }
+    twi_recover_bus();
+    return 1;
+}
+
+/*
+ * Returns zero if transfer succeeded, otherwise the TWI status code which caused the failure, or one of
+ * TWI_STATUS_TIMEOUT and TWI_STATUS_BUS_ERROR. Waiting is bounded by TWI_TRANSFER_TIMEOUT_US.
+ *
+ */
+uint8_t poll_for_twi_transmitted()
+{
+    uint8_t status;
+
+    while (!twi_get_completion(&status));
+    return status;
+}
+
+void get_twi_error_counters(twi_error_counters_t *counters)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        *counters = twi_error_counters;
+    }
     return;
 }
 
@@ -59,7 +234,7 @@ void poll_for_twi_transmitted()
  * 2. main prb writes I2C command into buffer
  * 3. main prb starts I2C operation, i.e. start sending
  * 4. following parts are handled by ISR
- * 5. ISR indicates main prb about completion of the procedure (actually main prb polls I2C state...)
+ * 5. ISR indicates main prb about completion of the procedure by putting its status into completion buffer
  *
  */
 ISR(TWI_vect)
@@ -88,6 +263,12 @@ ISR(TWI_vect)
             twi_error(errorcode);
             break;
         }
+        if (i2c_state.data_length == 0)
+        {
+            /* Address only, e.g. probing if device is present */
+            twi_complete();
+            break;
+        }
         TWDR = *i2c_state.data_ptr;
         i2c_state.data_ptr++;
         i2c_state.data_length--;
@@ -114,11 +295,8 @@ ISR(TWI_vect)
         }
         else
         {
-            /* No more data */
-            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
-            
-            /* Acknowledge to upper layer transmission complete! */
-            i2c_state.state = WR_STOP_SENDING;
+            /* No more data, acknowledge to upper layer transmission complete! */
+            twi_complete();
         }
         break;
         
@@ -126,7 +304,7 @@ ISR(TWI_vect)
         break;
         
         case    WR_ERROR:
-        /* Maybe something should be done here... */
+        /* STOP has already been requested, nothing to be done until next transfer */
         break;
         
         default:
@@ -20,6 +20,28 @@
 #define TWI_MSS_DATA_TRANSMITTED_ACK_RECEIVED 0x28
 #define TWI_MSS_DATA_TRANMITTED_NO_ACK_RECEIVED 0x30
 #define TWI_MSS_DATA_TRANSMITTED_ARBITRATION_LOST 0x38
+#define TWI_BUS_ERROR 0x00
+
+/*
+ * Transfer results which are not TWI status codes. Status codes have zero prescaler bits, so these cannot collide.
+ *
+ */
+#define TWI_STATUS_TIMEOUT 0x01 /* Transfer did not finish in time, bus has been recovered */
+#define TWI_STATUS_BUS_ERROR 0x02 /* TWI_BUS_ERROR, which would look like success */
+
+#define TWI_STANDARD_MODE_RATE 100000UL
+#define TWI_FAST_MODE_RATE 400000UL
+#ifndef TWI_BIT_RATE
+#define TWI_BIT_RATE TWI_STANDARD_MODE_RATE /* Build with -DTWI_BIT_RATE=400000UL for fast mode */
+#endif
+#define TWI_FALLBACK_RATE TWI_STANDARD_MODE_RATE /* For devices which do not work at TWI_BIT_RATE */
+
+#define TWI_COMPLETION_BUFFER_SIZE 4
+#define TWI_TRANSFER_TIMEOUT_US 5000 /* Longest transfer takes about 0,5ms at 100kbit/s */
+#define TWI_SDA_PIN PC4
+#define TWI_SCL_PIN PC5
+#define TWI_RECOVERY_CLOCKS 9 /* Slave holding SDA low releases it within one byte and ACK */
+#define TWI_RECOVERY_HALF_PERIOD_US 5
 
 /*
  * I2C read is not complete...
@@ -44,9 +66,25 @@ typedef struct
     uint8_t address;
     uint8_t data_length;
     uint8_t *data_ptr;
-    uint8_t status; /* This is relevant only if an error occured */
 } twi_i2c_state_t;
 
+typedef enum
+{
+    TWI_RATE_DEFAULT = 0, /* TWI_BIT_RATE */
+    TWI_RATE_FALLBACK /* TWI_FALLBACK_RATE */
+} twi_rate_t;
+
+/* Cumulative error counters of the TWI driver */
+typedef struct
+{
+    uint16_t nacks; /* Address or data not acknowledged */
+    uint16_t bus_errors; /* Bus error or an unexpected status code */
+    uint16_t arbitration_lost;
+    uint16_t timeouts;
+    uint16_t recoveries;
+    uint16_t stuck_bus; /* SDA still low after recovery clocks */
+} twi_error_counters_t;
+
 typedef enum
 {
     INTERFACE_4_BITS,
@@ -55,8 +93,12 @@ typedef enum
 
 
 void init_twi();
+void twi_select_rate(twi_rate_t rate);
 void twi_send_command(uint8_t address, uint8_t length, uint8_t *data);
-void poll_for_twi_transmitted();
+uint8_t twi_get_completion(uint8_t *status);
+uint8_t poll_for_twi_transmitted();
+void twi_recover_bus(void);
+void get_twi_error_counters(twi_error_counters_t *counters);
 
 
 #endif /* I2C_H_ */
\ No newline at end of file
@@ -0,0 +1,353 @@
+/*
+ * i2c_bus.c
+ *
+ *
+ * I2C bus manager on top of the TWI driver.
+ *
+ * Devices found by probing at startup are kept in a device table, and each device has its own small queue of
+ * write transfers. Bus is shared in round robin fashion: after each transfer the next device having something
+ * queued gets its turn, so a device with a long queue (e.g. a display being refreshed) cannot starve the others.
+ * Transfers are short (at most I2C_BUS_MAX_TRANSFER bytes), which bounds the time one device can hold the bus.
+ * Each device has its own bit rate, which is selected before each of its transfers.
+ *
+ * A failed transfer is retried after a backoff delay, and dropped after I2C_BUS_MAX_ATTEMPTS. If several
+ * transfers in a row are dropped (e.g. display unplugged), device goes offline: its queue is emptied, new writes
+ * are rejected right away, and it is probed every I2C_BUS_REPROBE_INTERVAL_US until it answers again.
+ * So a bad device costs only bounded time, and the rest of the program keeps running.
+ *
+ * Everything here is run by main program, TWI ISR only handles the transfer which is on the bus and reports
+ * its completion through a ring buffer.
+ *
+ * Bus can be held for a timing critical period (AM2301 capture window): transfer on the bus is completed,
+ * but no new transfer is started until the hold is released or its deadline passes. Deadline makes sure a lost
+ * release cannot stop the bus for good. Functions which wait for the bus (write to a full queue, flush, probe)
+ * wait through the hold.
+ */
+
+#include <avr/io.h>
+#include <string.h>
+
+#include "i2c.h"
+#include "i2c_bus.h"
+#include "timer.h"
+
+i2c_device_t i2c_devices[I2C_BUS_MAX_DEVICES];
+uint8_t i2c_devices_found = 0;
+uint8_t active_device = I2C_BUS_NO_DEVICE; /* Device whose transfer is on the bus */
+uint8_t next_device = 0; /* Round robin position */
+uint8_t bus_held = 0;
+uint32_t bus_hold_deadline;
+
+/*
+ * Check if there is a device responding to given address at given bit rate. Probing is done by sending only
+ * the address, so the device does not receive any data.
+ *
+ */
+uint8_t i2c_bus_probe(uint8_t address, twi_rate_t rate)
+{
+    /* Wait for queued transfer on the bus to complete */
+    while ((active_device != I2C_BUS_NO_DEVICE) || i2c_bus_held())
+    {
+        i2c_bus_service();
+    }
+    twi_select_rate(rate);
+    twi_send_command(address, 0, NULL);
+    return (poll_for_twi_transmitted() == 0);
+}
+
+/*
+ * Probe given address range, and add responding devices into device table. Returns number of new devices.
+ *
+ * Addresses are probed at TWI_BIT_RATE first. If that is faster than TWI_FALLBACK_RATE, an address which did not
+ * answer is probed again at the fallback rate, and a device found that way uses the fallback rate from then on.
+ *
+ */
+uint8_t i2c_bus_scan(uint8_t first_address, uint8_t last_address)
+{
+    uint8_t address, found = 0, responded;
+    twi_rate_t rate;
+
+    for (address = first_address; address <= last_address; address++)
+    {
+        if (i2c_bus_find_device(address) == I2C_BUS_NO_DEVICE)
+        {
+            rate = TWI_RATE_DEFAULT;
+            responded = i2c_bus_probe(address, rate);
+            if (!responded && (TWI_BIT_RATE != TWI_FALLBACK_RATE))
+            {
+                rate = TWI_RATE_FALLBACK;
+                responded = i2c_bus_probe(address, rate);
+            }
+            if (responded)
+            {
+                if (i2c_bus_add_device(address, rate) == I2C_BUS_NO_DEVICE)
+                {
+                    /* Device table is full */
+                    break;
+                }
+                found++;
+            }
+        }
+        if (address == last_address) break; /* Avoid wrapping if range ends at 0xff */
+    }
+    return found;
+}
+
+uint8_t i2c_bus_add_device(uint8_t address, twi_rate_t rate)
+{
+    i2c_device_t *device;
+
+    if (i2c_devices_found >= I2C_BUS_MAX_DEVICES)
+    {
+        return I2C_BUS_NO_DEVICE;
+    }
+    device = &i2c_devices[i2c_devices_found];
+    memset(device, 0, sizeof(*device));
+    device->address = address;
+    device->rate = rate;
+    device->counters.online = 1;
+    return i2c_devices_found++;
+}
+
+uint8_t i2c_bus_find_device(uint8_t address)
+{
+    uint8_t i;
+
+    for (i = 0; i < i2c_devices_found; i++)
+    {
+        if (i2c_devices[i].address == address) return i;
+    }
+    return I2C_BUS_NO_DEVICE;
+}
+
+uint8_t i2c_bus_device_count(void)
+{
+    return i2c_devices_found;
+}
+
+uint8_t i2c_bus_device_address(uint8_t device)
+{
+    return i2c_devices[device].address;
+}
+
+/*
+ * Change bit rate of device at run time. Transfer already on the bus is not affected.
+ *
+ */
+void i2c_bus_set_device_rate(uint8_t device, twi_rate_t rate)
+{
+    if (device < i2c_devices_found)
+    {
+        i2c_devices[device].rate = rate;
+    }
+    return;
+}
+
+void i2c_bus_get_device_counters(uint8_t device, i2c_device_counters_t *counters)
+{
+    *counters = i2c_devices[device].counters;
+    return;
+}
+
+/*
+ * Queue a write transfer to device. Data is copied, so caller may reuse its buffer immediately.
+ * If device queue is full, bus is serviced until there is room. Returns zero if transfer was rejected,
+ * e.g. because device is offline.
+ *
+ */
+uint8_t i2c_bus_write(uint8_t device, uint8_t length, const uint8_t *data)
+{
+    i2c_device_t *dev;
+    i2c_transfer_t *transfer;
+
+    if ((device >= i2c_devices_found) || (length > I2C_BUS_MAX_TRANSFER))
+    {
+        return 0;
+    }
+    dev = &i2c_devices[device];
+    while (dev->counters.online && (dev->count >= I2C_BUS_QUEUE_LENGTH))
+    {
+        i2c_bus_service();
+    }
+    if (!dev->counters.online)
+    {
+        /* Keeps probing going */
+        i2c_bus_service();
+        return 0;
+    }
+    transfer = &dev->queue[(dev->head + dev->count) & (I2C_BUS_QUEUE_LENGTH - 1)];
+    transfer->length = length;
+    memcpy(transfer->data, data, length);
+    dev->count++;
+
+    /* Start it right away if bus is idle */
+    i2c_bus_service();
+    return 1;
+}
+
+void drop_oldest_transfer(i2c_device_t *dev)
+{
+    dev->head = (dev->head + 1) & (I2C_BUS_QUEUE_LENGTH - 1);
+    dev->count--;
+    dev->attempts = 0;
+    return;
+}
+
+/*
+ * Handle the result of device's transfer: success, retry later, drop, or take the device offline.
+ * For an offline device the transfer was a probe.
+ *
+ */
+void complete_transfer(i2c_device_t *dev, uint8_t status)
+{
+    if (!dev->counters.online)
+    {
+        if (status == 0)
+        {
+            dev->counters.online = 1;
+            dev->failures = 0;
+        }
+        else
+        {
+            dev->retry_time = get_microseconds() + I2C_BUS_REPROBE_INTERVAL_US;
+        }
+        return;
+    }
+    if (status == 0)
+    {
+        dev->counters.transfers++;
+        dev->failures = 0;
+        drop_oldest_transfer(dev);
+        return;
+    }
+    dev->attempts++;
+    if (dev->attempts < I2C_BUS_MAX_ATTEMPTS)
+    {
+        dev->counters.retries++;
+        dev->retry_time = get_microseconds() + (I2C_BUS_RETRY_BACKOFF_US << (dev->attempts - 1));
+        return;
+    }
+    dev->counters.errors++;
+    drop_oldest_transfer(dev);
+    dev->failures++;
+    if (dev->failures >= I2C_BUS_OFFLINE_FAILURES)
+    {
+        dev->counters.errors += dev->count;
+        dev->count = 0;
+        dev->counters.online = 0;
+        dev->retry_time = get_microseconds() + I2C_BUS_REPROBE_INTERVAL_US;
+    }
+    return;
+}
+
+/*
+ * Device may start a transfer if it has something queued and is not waiting for a retry,
+ * or if it is offline and due for probing.
+ *
+ */
+uint8_t device_ready(const i2c_device_t *dev)
+{
+    if (!dev->counters.online)
+    {
+        return timer_expired(dev->retry_time);
+    }
+    if (dev->count == 0)
+    {
+        return 0;
+    }
+    return (dev->attempts == 0) || timer_expired(dev->retry_time);
+}
+
+/*
+ * Complete the transfer on the bus if TWI has finished it, and start the next one.
+ * Devices are served in round robin order, one transfer at a time.
+ *
+ */
+void i2c_bus_service(void)
+{
+    i2c_device_t *dev;
+    uint8_t i, candidate, status;
+
+    if (active_device != I2C_BUS_NO_DEVICE)
+    {
+        if (!twi_get_completion(&status))
+        {
+            return;
+        }
+        complete_transfer(&i2c_devices[active_device], status);
+        active_device = I2C_BUS_NO_DEVICE;
+    }
+    if (i2c_bus_held())
+    {
+        return;
+    }
+
+    for (i = 0; i < i2c_devices_found; i++)
+    {
+        candidate = next_device + i;
+        if (candidate >= i2c_devices_found) candidate -= i2c_devices_found;
+        dev = &i2c_devices[candidate];
+        if (device_ready(dev))
+        {
+            active_device = candidate;
+            next_device = (candidate + 1 < i2c_devices_found) ? candidate + 1 : 0;
+            twi_select_rate(dev->rate);
+            if (dev->counters.online)
+            {
+                twi_send_command(dev->address, dev->queue[dev->head].length, dev->queue[dev->head].data);
+            }
+            else
+            {
+                twi_send_command(dev->address, 0, NULL);
+            }
+            return;
+        }
+    }
+    return;
+}
+
+/*
+ * Wait until all transfers queued for the device have been sent. Other devices' transfers
+ * keep going meanwhile.
+ *
+ */
+void i2c_bus_flush(uint8_t device)
+{
+    if (device >= i2c_devices_found)
+    {
+        return;
+    }
+    while (i2c_devices[device].count > 0)
+    {
+        i2c_bus_service();
+    }
+    return;
+}
+
+/*
+ * Do not start new transfers until i2c_bus_release() or deadline given by get_microseconds().
+ * A new hold replaces the previous deadline.
+ *
+ */
+void i2c_bus_hold(uint32_t until)
+{
+    bus_hold_deadline = until;
+    bus_held = 1;
+    return;
+}
+
+void i2c_bus_release(void)
+{
+    bus_held = 0;
+    i2c_bus_service();
+    return;
+}
+
+uint8_t i2c_bus_held(void)
+{
+    if (bus_held && timer_expired(bus_hold_deadline))
+    {
+        bus_held = 0;
+    }
+    return bus_held;
+}
@@ -0,0 +1,64 @@
+/*
+ * i2c_bus.h
+ *
+ *
+ */
+
+
+#ifndef I2C_BUS_H_
+#define I2C_BUS_H_
+
+#define I2C_BUS_MAX_DEVICES 4
+#define I2C_BUS_QUEUE_LENGTH 4 /* Transfers queued per device */
+#define I2C_BUS_MAX_TRANSFER 4 /* Bytes per transfer, one 4-bit LCD command */
+#define I2C_BUS_FIRST_ADDRESS 0x08 /* Addresses below and above these are reserved by I2C specification */
+#define I2C_BUS_LAST_ADDRESS 0x77
+#define I2C_BUS_NO_DEVICE 0xff
+#define I2C_BUS_MAX_ATTEMPTS 3 /* Per transfer, failed transfer is dropped after this */
+#define I2C_BUS_RETRY_BACKOFF_US 1000UL /* Before first retry, doubled for each further one */
+#define I2C_BUS_OFFLINE_FAILURES 4 /* Consecutive dropped transfers which take device offline */
+#define I2C_BUS_REPROBE_INTERVAL_US 5000000UL /* Offline device is probed this often */
+
+typedef struct
+{
+    uint8_t length;
+    uint8_t data[I2C_BUS_MAX_TRANSFER];
+} i2c_transfer_t;
+
+typedef struct
+{
+    uint16_t transfers;
+    uint16_t errors; /* Dropped transfers */
+    uint16_t retries;
+    uint8_t online;
+} i2c_device_counters_t;
+
+typedef struct
+{
+    uint8_t address;
+    uint8_t head; /* Oldest queued transfer, it is the one on the bus if device is active */
+    uint8_t count;
+    uint8_t attempts; /* Failed attempts of the oldest transfer */
+    uint8_t failures; /* Consecutive dropped transfers */
+    uint8_t rate; /* twi_rate_t */
+    uint32_t retry_time; /* Earliest time for retry or probing, see get_microseconds() */
+    i2c_transfer_t queue[I2C_BUS_QUEUE_LENGTH];
+    i2c_device_counters_t counters;
+} i2c_device_t;
+
+uint8_t i2c_bus_probe(uint8_t address, twi_rate_t rate);
+uint8_t i2c_bus_scan(uint8_t first_address, uint8_t last_address);
+uint8_t i2c_bus_add_device(uint8_t address, twi_rate_t rate);
+void i2c_bus_set_device_rate(uint8_t device, twi_rate_t rate);
+uint8_t i2c_bus_find_device(uint8_t address);
+uint8_t i2c_bus_device_count(void);
+uint8_t i2c_bus_device_address(uint8_t device);
+void i2c_bus_get_device_counters(uint8_t device, i2c_device_counters_t *counters);
+uint8_t i2c_bus_write(uint8_t device, uint8_t length, const uint8_t *data);
+void i2c_bus_service(void);
+void i2c_bus_flush(uint8_t device);
+void i2c_bus_hold(uint32_t until);
+void i2c_bus_release(void);
+uint8_t i2c_bus_held(void);
+
+#endif /* I2C_BUS_H_ */
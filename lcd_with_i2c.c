@@ -20,36 +20,100 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <stddef.h>
 
 #include "lcd_with_i2c.h"
 #include "i2c.h"
+#include "i2c_bus.h"
+#include "timer.h"
 
-void send_i2c_lcd_command_8bit_mode(uint8_t address, uint8_t rs, uint8_t data);
-void send_i2c_lcd_command_4bit_mode(uint8_t address, uint8_t rs, uint8_t data);
+void send_i2c_lcd_command_8bit_mode(i2c_lcd_data_t *lcd, uint8_t rs, uint8_t data);
+void send_i2c_lcd_command_4bit_mode(i2c_lcd_data_t *lcd, uint8_t rs, uint8_t data);
 
 
-uint8_t lcd_i2c_byte;
-uint8_t lcd_backlight_command;
-uint8_t lcd_backlight = LCD_BACKLIGHT;
-
-i2c_lcd_data_t i2c_lcd_data = {0x3f, 2, 16};
+/* Displays attached to I2C bus, LCD functions operate on the selected one */
+i2c_lcd_data_t lcd_displays[LCD_MAX_DISPLAYS];
+uint8_t lcd_display_count = 0;
+i2c_lcd_data_t *current_lcd = NULL;
     
-lcd_command_table_t lcd_commands[13] = { \
-    {SCREEN_CLEAR, 0, 0, 0x01, 1640},\
-    {CURSOR_RETURN, 0, 0, 0x02, 1640},\
-    {INPUT_SET, 0, 0, 0x04, 40},\
-    {DISPLAY_SWITCH, 0, 0, 0x08, 40},\
-    {SHIFT, 0, 0, 0x10, 40},\
-    {FUNCTION_SET, 0, 0, 0x20, 40},\
-    {CGRAM_AD_SET, 0, 0, 0x40, 40},\
-    {DDRAM_AD_SET, 0, 0, 0x80, 40},\
-    {BUSY_AD_READ_CT, 0, 1, 0x00, 40},\
-    {CGRAM_DATA_WRITE, 1, 0, 0x00, 40},\
-    {DDRAM_DATA_WRITE, 1, 0, 0x00, 40},\
-    {CGRAM_DATA_READ, 1, 1, 0x00, 40},\
-    {DDRAM_DATA_READ, 1, 1, 0x00, 40}
+/* Indexed by lcd_command_name_t, kept in flash */
+const lcd_command_table_t lcd_commands[] PROGMEM = { \
+    [SCREEN_CLEAR] = {0, 0, 0x01, 1640},\
+    [CURSOR_RETURN] = {0, 0, 0x02, 1640},\
+    [INPUT_SET] = {0, 0, 0x04, 40},\
+    [DISPLAY_SWITCH] = {0, 0, 0x08, 40},\
+    [SHIFT] = {0, 0, 0x10, 40},\
+    [FUNCTION_SET] = {0, 0, 0x20, 40},\
+    [CGRAM_AD_SET] = {0, 0, 0x40, 40},\
+    [DDRAM_AD_SET] = {0, 0, 0x80, 40},\
+    [BUSY_AD_READ_CT] = {0, 1, 0x00, 40},\
+    [DDRAM_DATA_WRITE] = {1, 0, 0x00, 40},\
+    [CGRAM_DATA_WRITE] = {1, 0, 0x00, 40},\
+    [DDRAM_DATA_READ] = {1, 1, 0x00, 40},\
+    [CGRAM_DATA_READ] = {1, 1, 0x00, 40}
 };
 
+/*
+ * Attach a display behind an I2C bus device. Returns display number, or LCD_NO_DISPLAY if all slots are in use.
+ *
+ */
+uint8_t lcd_attach(uint8_t device)
+{
+    i2c_lcd_data_t *lcd;
+
+    if (lcd_display_count >= LCD_MAX_DISPLAYS)
+    {
+        return LCD_NO_DISPLAY;
+    }
+    lcd = &lcd_displays[lcd_display_count];
+    lcd->device = device;
+    lcd->rows = 2;
+    lcd->columns = 16;
+    lcd->backlight = LCD_BACKLIGHT;
+    lcd->display_shift = 0;
+    if (current_lcd == NULL)
+    {
+        current_lcd = lcd;
+    }
+    return lcd_display_count++;
+}
+
+/*
+ * Attach all probed bus devices which have an I2C expander address: PCF8574 uses 0x20-0x27 and PCF8574A 0x38-0x3f.
+ * Returns number of displays attached.
+ *
+ */
+uint8_t lcd_attach_detected(void)
+{
+    uint8_t device, address, attached = 0;
+
+    for (device = 0; device < i2c_bus_device_count(); device++)
+    {
+        address = i2c_bus_device_address(device);
+        if (((address >= 0x20) && (address <= 0x27)) || ((address >= 0x38) && (address <= 0x3f)))
+        {
+            if (lcd_attach(device) == LCD_NO_DISPLAY) break;
+            attached++;
+        }
+    }
+    return attached;
+}
+
+uint8_t lcd_get_display_count(void)
+{
+    return lcd_display_count;
+}
+
+void lcd_select(uint8_t display)
+{
+    if (display < lcd_display_count)
+    {
+        current_lcd = &lcd_displays[display];
+    }
+    return;
+}
+
 /*
  * LCD backlight can be set separately from LCD commands, just be sure not to set EN signal
  * so the LCD does not read these databits.
@@ -57,28 +121,33 @@ lcd_command_table_t lcd_commands[13] = { \
  */
 void change_lcd_backlight(uint8_t new_state)
 {
-    lcd_backlight = new_state & 1;
+    uint8_t lcd_backlight_command;
+
+    if (current_lcd == NULL) return;
+    current_lcd->backlight = new_state & 1;
     /* Update state immediately */
-    lcd_backlight_command = (lcd_backlight << 3);
-    twi_send_command(0x3f, 1, &lcd_backlight_command);
-    poll_for_twi_transmitted();
+    lcd_backlight_command = (current_lcd->backlight << 3);
+    i2c_bus_write(current_lcd->device, 1, &lcd_backlight_command);
+    i2c_bus_flush(current_lcd->device);
 
     return;
 }
 
 void lcd_write_command(lcd_command_name_t command, uint8_t parameter)
 {
+    const lcd_command_table_t *entry = &lcd_commands[command];
     uint8_t cpc;
     uint8_t rs;
-    uint32_t i;
     
-    cpc = lcd_commands[command].command_binary_code | parameter; /* Command and Parameter Combined... */
-    rs = lcd_commands[command].rs;
+    if (current_lcd == NULL) return;
+    cpc = pgm_read_byte(&entry->command_binary_code) | parameter; /* Command and Parameter Combined... */
+    rs = pgm_read_byte(&entry->rs);
 
-    send_i2c_lcd_command_4bit_mode(0x3f, rs, cpc);
+    send_i2c_lcd_command_4bit_mode(current_lcd, rs, cpc);
+    i2c_bus_flush(current_lcd->device);
     
-    /* Execute delay according to commands' delay value */
-    for (i = 0; i < 5 * lcd_commands[command].execution_time_us; i++);
+    /* Execute delay according to commands' delay value, counted from the end of the transfer */
+    delay_microseconds(pgm_read_word(&entry->execution_time_us));
     return;
 }
 void lcd_write_character(uint8_t chr)
@@ -92,71 +161,252 @@ void lcd_clear_screen(void)
     return;
 }
 
-void lcd_write_string(uint8_t row, uint8_t column, const char *ptr)
+uint8_t lcd_row_address(uint8_t row)
 {
-    /* "row" and "column" start from zero */
-    
-    uint8_t lcd_screen_address = 0, row_base = 0;
-    uint8_t i;
-    
     switch (row)
     {
-        case 0:
-        row_base = 0;
-        break;
-        
         case 1:
-        row_base = 0x40;
-        break;
+        return 0x40;
         
         default:
-        row_base = 0;
-        break;
+        return 0;
     }
-    lcd_screen_address = row_base + column;
-    lcd_write_command(DDRAM_AD_SET, lcd_screen_address);
+}
+
+/*
+ * Set DDRAM address of a visible position. While marquee has shifted the display left, visible column 0
+ * shows DDRAM column display_shift. Returns the DDRAM column.
+ *
+ */
+uint8_t lcd_set_visible_position(uint8_t row, uint8_t column)
+{
+    uint8_t ddram_column;
+    
+    ddram_column = (column + current_lcd->display_shift) % LCD_DDRAM_LINE_LENGTH;
+    lcd_write_command(DDRAM_AD_SET, lcd_row_address(row) + ddram_column);
+    return ddram_column;
+}
+
+/*
+ * Write a character to a visible row. Address counter does not wrap from the end of a DDRAM row to its
+ * beginning, so the address is set again where shifted visible area continues from DDRAM column 0.
+ *
+ */
+void lcd_write_visible_character(uint8_t row, uint8_t *ddram_column, char chr)
+{
+    if (*ddram_column >= LCD_DDRAM_LINE_LENGTH)
+    {
+        *ddram_column = 0;
+        lcd_write_command(DDRAM_AD_SET, lcd_row_address(row));
+    }
+    lcd_write_character(chr);
+    (*ddram_column)++;
+    return;
+}
+
+void lcd_write_string(uint8_t row, uint8_t column, const char *ptr)
+{
+    /* "row" and "column" start from zero, and they are visible position also when display is shifted */
+    
+    uint8_t ddram_column;
+    uint8_t i;
+    
+    if (current_lcd == NULL) return;
+    ddram_column = lcd_set_visible_position(row, column);
 
     /* Data address set, send string char by char */
-    i = 0;
-    for (i = 0; i < 16; i++)
+    for (i = 0; i < current_lcd->columns; i++)
     {
         if (ptr[i] == 0) break;
-        lcd_write_character(ptr[i]);
+        lcd_write_visible_character(row, &ddram_column, ptr[i]);
     }
 
     return;
 }
-void unaccurate_delay(uint8_t milliseconds)
+
+/*
+ * Same as lcd_write_string(), but string is in flash (PSTR).
+ *
+ */
+void lcd_write_string_P(uint8_t row, uint8_t column, const char *ptr)
 {
-    /* A rough accuracy delay */
+    uint8_t ddram_column;
+    uint8_t i;
+    char chr;
     
-    uint32_t i;
+    if (current_lcd == NULL) return;
+    ddram_column = lcd_set_visible_position(row, column);
+    for (i = 0; i < current_lcd->columns; i++)
+    {
+        chr = pgm_read_byte(&ptr[i]);
+        if (chr == 0) break;
+        lcd_write_visible_character(row, &ddram_column, chr);
+    }
+    return;
+}
+
+/*
+ * Marquee mode for text longer than display width.
+ *
+ * Whole DDRAM line (40 characters) is loaded once, padded with spaces, and it is scrolled by shifting
+ * the display with lcd_marquee_step(), which is a single command instead of rewriting the visible row.
+ * Note that HD44780 shifts all rows together, so the other row moves as well; lcd_write_string() writes
+ * to the visible position of the shifted display. Display returns to its original position after
+ * LCD_DDRAM_LINE_LENGTH steps, or immediately with lcd_marquee_reset().
+ *
+ */
+void lcd_write_marquee(uint8_t row, const char *ptr)
+{
+    uint8_t i;
     
-    for (i = 0; i < (16000 * milliseconds); i++);
+    if (current_lcd == NULL) return;
+    lcd_write_command(DDRAM_AD_SET, lcd_row_address(row));
+    for (i = 0; i < LCD_DDRAM_LINE_LENGTH; i++)
+    {
+        if (*ptr != 0)
+        {
+            lcd_write_character(*ptr);
+            ptr++;
+        }
+        else
+        {
+            lcd_write_character(' ');
+        }
+    }
+    return;
+}
+
+void lcd_marquee_step(void)
+{
+    if (current_lcd == NULL) return;
+    lcd_write_command(SHIFT, SHIFT_DISPLAY_SHIFT | SHIFT_LEFT_SHIFT);
+    current_lcd->display_shift++;
+    if (current_lcd->display_shift >= LCD_DDRAM_LINE_LENGTH)
+    {
+        /* Shifted all the way around, display is back at original position */
+        current_lcd->display_shift = 0;
+    }
     return;
 }
 
+void lcd_marquee_reset(void)
+{
+    if ((current_lcd == NULL) || (current_lcd->display_shift == 0)) return;
+    lcd_write_command(CURSOR_RETURN, 0);
+    current_lcd->display_shift = 0;
+    return;
+}
+
+/*
+ * Initialisation sequence. It starts in "8-bit mode", where only 4 MSBs of a command are written once.
+ * Delays are counted from the end of the transfer to all displays. First step waits for LCD power-on,
+ * counted from boot (init_timer). Commands are encoded from lcd_commands[], delay 0 means execution time
+ * of the command. Steps are kept in flash.
+ *
+ */
+const lcd_init_step_t lcd_init_steps[] PROGMEM = { \
+    {1, FUNCTION_SET, FUNCTION_SET_8D, 20000},\
+    {1, FUNCTION_SET, FUNCTION_SET_8D, 10000},\
+    {1, FUNCTION_SET, FUNCTION_SET_8D, 1000},\
+    {1, FUNCTION_SET, FUNCTION_SET_4D, 2000}, /* Switch to 4bit command mode */\
+    {0, FUNCTION_SET, FUNCTION_SET_4D | FUNCTION_SET_2R | FUNCTION_SET_5X7, 0},\
+    {0, DISPLAY_SWITCH, DISPLAY_SWITCH_DISPLAY_OFF, 0},\
+    {0, SCREEN_CLEAR, 0, 0},\
+    {0, INPUT_SET, INPUT_SET_INCREMENT_MODE | INPUT_SET_NO_SHIFT, 0},\
+    {0, DISPLAY_SWITCH, DISPLAY_SWITCH_DISPLAY_ON, 0}
+};
+
+uint8_t lcd_init_step = LCD_INIT_DONE;
+uint32_t lcd_init_deadline;
+
 /*
- * Although I2C interface LCD uses 4bit mode - it must be initially configured in "8-bit mode".
+ * Send the same command to every attached display, and wait until all have received it.
+ * Displays are initialised side by side, so they share the initialisation delays.
+ *
+ */
+void send_command_to_all(uint8_t eight_bit_mode, uint8_t data)
+{
+    uint8_t i;
+
+    for (i = 0; i < lcd_display_count; i++)
+    {
+        if (eight_bit_mode)
+        {
+            send_i2c_lcd_command_8bit_mode(&lcd_displays[i], 0, data);
+        }
+        else
+        {
+            send_i2c_lcd_command_4bit_mode(&lcd_displays[i], 0, data);
+        }
+    }
+    for (i = 0; i < lcd_display_count; i++)
+    {
+        i2c_bus_flush(lcd_displays[i].device);
+    }
+    return;
+}
+
+/*
+ * Start initialisation of all attached displays. It is run by lcd_init_poll(), so other start-up work
+ * can go on during the initialisation delays.
+ *
+ */
+void lcd_init_start(void)
+{
+    lcd_init_step = 0;
+    lcd_init_deadline = LCD_POWER_ON_DELAY_US;
+    return;
+}
+
+/*
+ * Send next initialisation command if its delay has passed. Returns non-zero when initialisation is complete.
+ *
+ */
+uint8_t lcd_init_poll(void)
+{
+    const lcd_init_step_t *step;
+    const lcd_command_table_t *command;
+    uint8_t eight_bit_mode, data;
+    uint16_t delay_us;
+
+    if (lcd_init_step == LCD_INIT_DONE)
+    {
+        return 1;
+    }
+    if (!timer_expired(lcd_init_deadline) || i2c_bus_held())
+    {
+        /* Bus hold only postpones the next command, initialisation delays are minimum times */
+        return 0;
+    }
+    if (lcd_init_step >= sizeof(lcd_init_steps) / sizeof(lcd_init_steps[0]))
+    {
+        /* Delay of the last command has passed, too */
+        lcd_init_step = LCD_INIT_DONE;
+        return 1;
+    }
+    step = &lcd_init_steps[lcd_init_step];
+    command = &lcd_commands[pgm_read_byte(&step->command)];
+    eight_bit_mode = pgm_read_byte(&step->eight_bit_mode);
+    data = pgm_read_byte(&command->command_binary_code) | pgm_read_byte(&step->parameter);
+    delay_us = pgm_read_word(&step->delay_us);
+    if (delay_us == 0)
+    {
+        delay_us = pgm_read_word(&command->execution_time_us);
+    }
+    send_command_to_all(eight_bit_mode, data);
+    lcd_init_deadline = get_microseconds() + delay_us;
+    lcd_init_step++;
+    return 0;
+}
+
+/*
+ * Blocking initialisation of all attached displays.
  *
  */
 void init_lcd()
 {
-    unaccurate_delay(100);
-    send_i2c_lcd_command_8bit_mode(0x3f, 0, 0x30);
-    unaccurate_delay(20);
-    send_i2c_lcd_command_8bit_mode(0x3f, 0, 0x30);
-    unaccurate_delay(10);
-    send_i2c_lcd_command_8bit_mode(0x3f, 0, 0x30);
-    unaccurate_delay(1);
-    send_i2c_lcd_command_8bit_mode(0x3f, 0, 0x20);  /* Switch to 4bit command mode */
-    unaccurate_delay(2);
-
-    lcd_write_command(FUNCTION_SET, FUNCTION_SET_4D | FUNCTION_SET_2R | FUNCTION_SET_5X7);
-    lcd_write_command(DISPLAY_SWITCH, DISPLAY_SWITCH_DISPLAY_OFF);
-    lcd_write_command(SCREEN_CLEAR, 0);
-    lcd_write_command(INPUT_SET, INPUT_SET_INCREMENT_MODE|INPUT_SET_NO_SHIFT);
-    lcd_write_command(DISPLAY_SWITCH, DISPLAY_SWITCH_DISPLAY_ON);
+    lcd_init_start();
+    while (!lcd_init_poll());
     return;
 }
 
@@ -168,19 +418,21 @@ void init_lcd()
  * sent by writing only 4MSB bits of 8bit command.
  * Therefore data is written only once
  *
+ * EN high and EN low states are sent in the same I2C transfer: expander updates its outputs after each
+ * received byte, so LCD sees the strobe.
+ *
  */
-void send_i2c_lcd_command_8bit_mode(uint8_t address, uint8_t rs, uint8_t data)
+void send_i2c_lcd_command_8bit_mode(i2c_lcd_data_t *lcd, uint8_t rs, uint8_t data)
 {
-    lcd_i2c_byte = data & 0xF0; /* Leave 4 MSBs, they are already at correct place! */
-    lcd_i2c_byte |= (lcd_backlight << 3);
-    lcd_i2c_byte |= (rs & 1);
-    lcd_i2c_byte |= (1 << 2); /* Set EN */
+    uint8_t lcd_i2c_bytes[2];
+
+    lcd_i2c_bytes[0] = data & 0xF0; /* Leave 4 MSBs, they are already at correct place! */
+    lcd_i2c_bytes[0] |= (lcd->backlight << 3);
+    lcd_i2c_bytes[0] |= (rs & 1);
+    lcd_i2c_bytes[0] |= (1 << 2); /* Set EN */
+    lcd_i2c_bytes[1] = lcd_i2c_bytes[0] ^ 0x4; /* Clear EN */
     
-    twi_send_command(address, 1, &lcd_i2c_byte);
-    poll_for_twi_transmitted();
-    lcd_i2c_byte ^= 0x4; /* Clear EN */
-    twi_send_command(address, 1, &lcd_i2c_byte);
-    poll_for_twi_transmitted();
+    i2c_bus_write(lcd->device, 2, lcd_i2c_bytes);
     return;
 }
 
@@ -189,29 +441,23 @@ void send_i2c_lcd_command_8bit_mode(uint8_t address, uint8_t rs, uint8_t data)
  * two parts, same way as with direct parallel mode interface
  *
  */
-void send_i2c_lcd_command_4bit_mode(uint8_t address, uint8_t rs, uint8_t data)
+void send_i2c_lcd_command_4bit_mode(i2c_lcd_data_t *lcd, uint8_t rs, uint8_t data)
 {
+    uint8_t lcd_i2c_bytes[4];
     
-    /* Send 8bit data in two 4-bit pieces over I2C to display */
+    /* Send 8bit data in two 4-bit pieces over I2C to display, as one I2C transfer */
     
-    lcd_i2c_byte = data & 0xF0; /* Leave 4 MSBs, they are already at correct place! */
-    lcd_i2c_byte |= (lcd_backlight << 3);
-    lcd_i2c_byte |= (rs & 1);
-    lcd_i2c_byte |= (1 << 2); /* Set EN */
-    twi_send_command(address, 1, &lcd_i2c_byte);
-    poll_for_twi_transmitted();
-    lcd_i2c_byte ^= 0x4; /* Clear EN */
-    twi_send_command(address, 1, &lcd_i2c_byte);
-    poll_for_twi_transmitted();
-    lcd_i2c_byte = (data << 4) & 0xf0;
-    lcd_i2c_byte |= (lcd_backlight << 3);
-    lcd_i2c_byte |= (rs & 1);
-    lcd_i2c_byte |= 0x4; /* Set EN */
-    twi_send_command(address, 1, &lcd_i2c_byte);
-    poll_for_twi_transmitted();
-    lcd_i2c_byte ^= 0x4; /* Clear EN */
-    twi_send_command(address, 1, &lcd_i2c_byte);
-    poll_for_twi_transmitted();
+    lcd_i2c_bytes[0] = data & 0xF0; /* Leave 4 MSBs, they are already at correct place! */
+    lcd_i2c_bytes[0] |= (lcd->backlight << 3);
+    lcd_i2c_bytes[0] |= (rs & 1);
+    lcd_i2c_bytes[0] |= (1 << 2); /* Set EN */
+    lcd_i2c_bytes[1] = lcd_i2c_bytes[0] ^ 0x4; /* Clear EN */
+    lcd_i2c_bytes[2] = (data << 4) & 0xf0;
+    lcd_i2c_bytes[2] |= (lcd->backlight << 3);
+    lcd_i2c_bytes[2] |= (rs & 1);
+    lcd_i2c_bytes[2] |= 0x4; /* Set EN */
+    lcd_i2c_bytes[3] = lcd_i2c_bytes[2] ^ 0x4; /* Clear EN */
+    i2c_bus_write(lcd->device, 4, lcd_i2c_bytes);
     return;
 }
 
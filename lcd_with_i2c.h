@@ -9,6 +9,11 @@
 #define LCD_WITH_I2C_H_
 
 #define LCD_BACKLIGHT 1
+#define LCD_MAX_DISPLAYS 2
+#define LCD_NO_DISPLAY 0xff
+#define LCD_DDRAM_LINE_LENGTH 40 /* DDRAM characters per row, visible or not */
+#define LCD_POWER_ON_DELAY_US 100000UL /* From boot to first initialisation command */
+#define LCD_INIT_DONE 0xff
 
 
 
@@ -54,22 +59,41 @@ typedef enum
 
 typedef struct
 {
-    lcd_command_name_t command_name;
     uint8_t rs;
     uint8_t rw;
     uint8_t command_binary_code;
-    uint32_t execution_time_us;
+    uint16_t execution_time_us;
 } lcd_command_table_t;
 
+typedef struct
+{
+    uint8_t eight_bit_mode;
+    uint8_t command; /* lcd_command_name_t */
+    uint8_t parameter;
+    uint16_t delay_us; /* Zero is execution time of the command */
+} lcd_init_step_t;
+
 typedef struct  
 {
-    uint8_t     address;
+    uint8_t     device; /* I2C bus device, see i2c_bus.h */
     uint8_t     rows;
     uint8_t     columns;
+    uint8_t     backlight;
+    uint8_t     display_shift; /* Marquee position, number of left shifts */
 } i2c_lcd_data_t;
 
+uint8_t lcd_attach(uint8_t device);
+uint8_t lcd_attach_detected(void);
+uint8_t lcd_get_display_count(void);
+void lcd_select(uint8_t display);
+void lcd_init_start(void);
+uint8_t lcd_init_poll(void);
 void init_lcd();
 void lcd_clear_screen(void);
 void lcd_write_string(uint8_t row, uint8_t column, const char *ptr);
+void lcd_write_string_P(uint8_t row, uint8_t column, const char *ptr);
+void lcd_write_marquee(uint8_t row, const char *ptr);
+void lcd_marquee_step(void);
+void lcd_marquee_reset(void);
 void change_lcd_backlight(uint8_t new_state);
 #endif /* LCD_WITH_I2C_H_ */
\ No newline at end of file
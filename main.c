@@ -6,35 +6,163 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "i2c.h"
+#include "i2c_bus.h"
 #include "lcd_with_i2c.h"
 #include "timer.h"
 #include "am2301.h"
+#include "uart.h"
+#include "query.h"
 
 #define MAX_LINE_LEN 16
+#define MEASUREMENT_INTERVAL_US 10000000UL
+#define AM2301_WAKEUP_INTERVAL_US 1000000UL /* From wake-up measurement to first real one */
 
-int main(void)
+typedef enum
+{
+    SENSOR_WAKEUP_READ = 0,
+    SENSOR_WAKEUP_WAIT,
+    SENSOR_FIRST_READ,
+    SENSOR_READY
+} sensor_boot_state_t;
+
+/*
+ * Same text is shown on every attached display
+ *
+ */
+void write_all_displays(uint8_t row, uint8_t column, const char *ptr)
+{
+    uint8_t display;
+
+    for (display = 0; display < lcd_get_display_count(); display++)
+    {
+        lcd_select(display);
+        lcd_write_string(row, column, ptr);
+    }
+    return;
+}
+
+/*
+ * Same for a string in flash (PSTR)
+ *
+ */
+void write_all_displays_P(uint8_t row, uint8_t column, const char *ptr)
+{
+    uint8_t display;
+
+    for (display = 0; display < lcd_get_display_count(); display++)
+    {
+        lcd_select(display);
+        lcd_write_string_P(row, column, ptr);
+    }
+    return;
+}
+
+/*
+ * Show latest decoded values on all displays
+ *
+ */
+void show_measurement(void)
 {
     char display_str[MAX_LINE_LEN];
 
+    get_am2301_temperature(display_str, MAX_LINE_LEN);
+    write_all_displays(0,0,display_str);
+    get_am2301_humidity(display_str, MAX_LINE_LEN);
+    write_all_displays(1,0,display_str);
+    return;
+}
+
+/*
+ * Start-up is run as two state machines side by side: LCD initialisation, and AM2301 wake-up followed by
+ * the first real measurement. AM2301 gives trash data from the first measurement after power-on,
+ * so that one is only used to wake it up. CPU sleeps whenever neither one has anything to do.
+ *
+ * Returns the time when first real measurement was started.
+ */
+uint32_t boot(void)
+{
+    sensor_boot_state_t sensor_state = SENSOR_WAKEUP_READ;
+    uint8_t lcd_ready = 0;
+    uint32_t wakeup_time, first_read_time = 0;
+
+    lcd_init_start();
+    wakeup_time = get_microseconds();
+    start_am2301_measurement();
+    while (!lcd_ready || (sensor_state != SENSOR_READY))
+    {
+        if (!lcd_ready && lcd_init_poll())
+        {
+            lcd_ready = 1;
+            if (sensor_state != SENSOR_READY)
+            {
+                write_all_displays_P(0,0,PSTR("Initializing"));
+                write_all_displays_P(1,0,PSTR("Wait..."));
+            }
+        }
+        switch (sensor_state)
+        {
+            case    SENSOR_WAKEUP_READ:
+                    if (am2301_measurement_ready())
+                    {
+                        /* Frame is ignored, it is not even decoded */
+                        sensor_state = SENSOR_WAKEUP_WAIT;
+                    }
+                    break;
+
+            case    SENSOR_WAKEUP_WAIT:
+                    if (timer_expired(wakeup_time + AM2301_WAKEUP_INTERVAL_US))
+                    {
+                        first_read_time = get_microseconds();
+                        start_am2301_measurement();
+                        sensor_state = SENSOR_FIRST_READ;
+                    }
+                    break;
+
+            case    SENSOR_FIRST_READ:
+                    if (am2301_measurement_ready())
+                    {
+                        process_am2301_measurement();
+                        query_update_cache();
+                        sensor_state = SENSOR_READY;
+                    }
+                    break;
+
+            default:
+                    break;
+        }
+        wait_for_interrupt();
+    }
+    return first_read_time;
+}
+
+int main(void)
+{
+    uint32_t measurement_time;
+
     SREG |= 128; /* Enable interrupts */
     init_timer();
+    init_uart();
+    query_update_cache(); /* Gateway gets answers already during initialisation */
     init_twi();
-    init_lcd();
-    lcd_write_string(0,0,"Initializing");
-    lcd_write_string(1,0,"Wait...");
-    initial_am2301_wakeup();
-    delay_seconds(1);
+    i2c_bus_scan(I2C_BUS_FIRST_ADDRESS, I2C_BUS_LAST_ADDRESS);
+    lcd_attach_detected();
+    measurement_time = boot();
     while (1) 
     {
+        show_measurement();
+        measurement_time += MEASUREMENT_INTERVAL_US;
+        while (!timer_expired(measurement_time))
+        {
+            wait_for_interrupt();
+        }
         start_am2301_measurement();
-        delay_seconds(1);
-        stop_am2301_measurement();
-        get_am2301_temperature(display_str, MAX_LINE_LEN);
-        lcd_write_string(0,0,display_str);
-        get_am2301_humidity(display_str, MAX_LINE_LEN);
-        lcd_write_string(1,0,display_str);
-        delay_seconds(9);
+        while (!am2301_measurement_ready())
+        {
+            wait_for_interrupt();
+        }
+        process_am2301_measurement();
+        query_update_cache();
     }
 }
-
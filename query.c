@@ -0,0 +1,303 @@
+/*
+ * query.c
+ *
+ *
+ * Query protocol for a gateway polling the node over UART.
+ *
+ * Responses are served only from cached data, a query never triggers a sensor read or waits for anything.
+ * To keep response time short and deterministic, complete response frames (including CRC) are built by
+ * main program after each measurement, and RX ISR only has to check the request and start transmission.
+ *
+ * There are two sets of response frames: one is published for ISR, the other one is being rebuilt by main
+ * program. ISR copies the requested frame into UART transmit buffer, so rebuilding never waits for transmission.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include <string.h>
+
+#include "query.h"
+#include "uart.h"
+#include "am2301.h"
+#include "timer.h"
+#include "i2c.h"
+#include "i2c_bus.h"
+
+_Static_assert(QUERY_MAX_RESPONSE <= UART_TX_BUFFER_SIZE, "response frame must fit into UART transmit buffer");
+
+query_response_set_t response_sets[2];
+volatile uint8_t published_set = 0;
+
+uint8_t request[QUERY_REQUEST_LENGTH];
+uint8_t request_length = 0;
+uint32_t last_received_tick;
+
+uint16_t calculate_crc(const uint8_t *data, uint8_t length)
+{
+    uint16_t crc = 0xffff;
+
+    while (length > 0)
+    {
+        crc = _crc16_update(crc, *data);
+        data++;
+        length--;
+    }
+    return crc;
+}
+
+uint8_t *put_uint16(uint8_t *ptr, uint16_t value)
+{
+    *ptr++ = value >> 8;
+    *ptr++ = value & 0xff;
+    return ptr;
+}
+
+uint8_t *put_uint32(uint8_t *ptr, uint32_t value)
+{
+    ptr = put_uint16(ptr, value >> 16);
+    return put_uint16(ptr, value & 0xffff);
+}
+
+/*
+ * Add header and CRC around the payload, which caller has already written at data[3] onwards.
+ *
+ */
+void finish_response(query_response_t *response, uint8_t function, uint8_t *payload_end)
+{
+    uint16_t crc;
+    uint8_t length;
+
+    length = payload_end - response->data;
+    response->data[0] = QUERY_NODE_ADDRESS;
+    response->data[1] = function;
+    response->data[2] = length - 3;
+    crc = calculate_crc(response->data, length);
+    response->data[length] = crc & 0xff;
+    response->data[length + 1] = crc >> 8;
+    response->length = length + 2;
+    return;
+}
+
+/*
+ * Latest sample: humidity and temperature in AM2301 format (0,1 units, temperature MSB is sign),
+ * validity code, sample number, system clock when the sample was taken, and filtered humidity and temperature.
+ *
+ */
+void build_latest_sample(query_response_t *response, const am2301_error_counters_t *counters, uint32_t now)
+{
+    am2301_sample_t sample;
+    uint8_t *ptr = &response->data[3];
+
+    get_am2301_sample(&sample);
+    ptr = put_uint16(ptr, sample.humidity_int);
+    ptr = put_uint16(ptr, sample.temperature_int);
+    *ptr++ = sample.data_validity;
+    ptr = put_uint16(ptr, counters->frames);
+    ptr = put_uint32(ptr, now);
+    get_am2301_filtered_sample(&sample);
+    ptr = put_uint16(ptr, sample.humidity_int);
+    ptr = put_uint16(ptr, sample.temperature_int);
+    finish_response(response, QUERY_LATEST_SAMPLE, ptr);
+    return;
+}
+
+void build_statistics(query_response_t *response, const am2301_error_counters_t *counters)
+{
+    uint8_t *ptr = &response->data[3];
+
+    ptr = put_uint16(ptr, counters->frames);
+    ptr = put_uint16(ptr, counters->valid);
+    ptr = put_uint16(ptr, counters->parity_errors);
+    ptr = put_uint16(ptr, counters->incomplete);
+    ptr = put_uint16(ptr, counters->no_response);
+    finish_response(response, QUERY_STATISTICS, ptr);
+    return;
+}
+
+/*
+ * Diagnostics: link quality of the latest frame (timer ticks, 0,5us), system clock,
+ * boot to first valid sample time (microseconds, zero if there is no valid sample yet) and
+ * worst capture interrupt latency of the latest frame (timer ticks).
+ *
+ */
+void build_diagnostics(query_response_t *response, uint32_t now)
+{
+    am2301_link_quality_t quality;
+    uint8_t *ptr = &response->data[3];
+
+    get_am2301_link_quality(&quality);
+    ptr = put_uint16(ptr, quality.zero_min);
+    ptr = put_uint16(ptr, quality.zero_max);
+    ptr = put_uint16(ptr, quality.one_min);
+    ptr = put_uint16(ptr, quality.one_max);
+    ptr = put_uint16(ptr, quality.zero_margin);
+    ptr = put_uint16(ptr, quality.one_margin);
+    ptr = put_uint16(ptr, quality.response_latency);
+    *ptr++ = quality.edge_count;
+    ptr = put_uint32(ptr, now);
+    ptr = put_uint32(ptr, get_am2301_first_valid_time());
+    ptr = put_uint16(ptr, quality.capture_latency_max);
+    finish_response(response, QUERY_DIAGNOSTICS, ptr);
+    return;
+}
+
+/*
+ * I2C bus statistics: TWI driver error counters, then number of devices and for each device its address
+ * (MSB set if device is online) and dropped transfers.
+ *
+ */
+_Static_assert(3 + 12 + 1 + QUERY_BUS_DEVICES * 3 + 2 <= QUERY_MAX_RESPONSE, "bus statistics must fit into response");
+
+void build_bus_statistics(query_response_t *response)
+{
+    twi_error_counters_t twi_counters;
+    i2c_device_counters_t device_counters;
+    uint8_t *ptr = &response->data[3];
+    uint8_t device, devices;
+
+    get_twi_error_counters(&twi_counters);
+    ptr = put_uint16(ptr, twi_counters.nacks);
+    ptr = put_uint16(ptr, twi_counters.bus_errors);
+    ptr = put_uint16(ptr, twi_counters.arbitration_lost);
+    ptr = put_uint16(ptr, twi_counters.timeouts);
+    ptr = put_uint16(ptr, twi_counters.recoveries);
+    ptr = put_uint16(ptr, twi_counters.stuck_bus);
+    devices = i2c_bus_device_count();
+    if (devices > QUERY_BUS_DEVICES)
+    {
+        devices = QUERY_BUS_DEVICES;
+    }
+    *ptr++ = devices;
+    for (device = 0; device < devices; device++)
+    {
+        i2c_bus_get_device_counters(device, &device_counters);
+        *ptr++ = i2c_bus_device_address(device) | (device_counters.online ? 0x80 : 0);
+        ptr = put_uint16(ptr, device_counters.errors);
+    }
+    finish_response(response, QUERY_BUS_STATISTICS, ptr);
+    return;
+}
+
+/*
+ * Rebuild response frames from latest decoded data, and publish them. Call this after each processed measurement.
+ *
+ */
+void query_update_cache(void)
+{
+    am2301_error_counters_t counters;
+    query_response_set_t *set;
+    uint8_t target;
+    uint32_t now;
+
+    target = published_set ^ 1;
+    set = &response_sets[target];
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        now = get_system_clock();
+    }
+    get_am2301_error_counters(&counters);
+    build_latest_sample(&set->latest_sample, &counters, now);
+    build_statistics(&set->statistics, &counters);
+    build_diagnostics(&set->diagnostics, now);
+    build_bus_statistics(&set->bus_statistics);
+    published_set = target;
+    return;
+}
+
+void send_exception(uint8_t function, uint8_t code)
+{
+    uint8_t exception_frame[5];
+    uint16_t crc;
+
+    exception_frame[0] = QUERY_NODE_ADDRESS;
+    exception_frame[1] = function | QUERY_EXCEPTION;
+    exception_frame[2] = code;
+    crc = calculate_crc(exception_frame, 3);
+    exception_frame[3] = crc & 0xff;
+    exception_frame[4] = crc >> 8;
+    uart_start_transmit(exception_frame, sizeof(exception_frame));
+    return;
+}
+
+void handle_request(void)
+{
+    query_response_set_t *set;
+
+    if (request[0] != QUERY_NODE_ADDRESS)
+    {
+        /* Request for some other node, or broadcast which is never answered */
+        return;
+    }
+    if (uart_transmit_busy())
+    {
+        /* Gateway did not wait for previous response, it will retry */
+        return;
+    }
+    set = &response_sets[published_set];
+    switch (request[1])
+    {
+        case    QUERY_LATEST_SAMPLE:
+                uart_start_transmit(set->latest_sample.data, set->latest_sample.length);
+                break;
+
+        case    QUERY_STATISTICS:
+                uart_start_transmit(set->statistics.data, set->statistics.length);
+                break;
+
+        case    QUERY_DIAGNOSTICS:
+                uart_start_transmit(set->diagnostics.data, set->diagnostics.length);
+                break;
+
+        case    QUERY_BUS_STATISTICS:
+                uart_start_transmit(set->bus_statistics.data, set->bus_statistics.length);
+                break;
+
+        default:
+                send_exception(request[1], QUERY_ILLEGAL_FUNCTION);
+                break;
+    }
+    return;
+}
+
+/*
+ * Called from UART RX ISR for each received byte.
+ *
+ * Request frame is found by sliding a window over the received bytes until CRC matches, so receiver
+ * synchronises to frames even without knowing where they start. CRC over the whole frame, including
+ * the CRC itself, is zero for a valid frame. A long gap or a reception error discards the partial frame.
+ *
+ */
+void query_receive_byte(uint8_t data, uint8_t error)
+{
+    uint32_t now = get_system_clock(); /* Interrupts are disabled in ISR, so this is consistent */
+
+    if (error)
+    {
+        request_length = 0;
+        return;
+    }
+    if ((request_length > 0) && ((now - last_received_tick) > QUERY_FRAME_GAP_TICKS))
+    {
+        request_length = 0;
+    }
+    last_received_tick = now;
+    request[request_length++] = data;
+    if (request_length < QUERY_REQUEST_LENGTH)
+    {
+        return;
+    }
+    if (calculate_crc(request, QUERY_REQUEST_LENGTH) == 0)
+    {
+        handle_request();
+        request_length = 0;
+    }
+    else
+    {
+        /* Not a frame, drop the oldest byte */
+        memmove(request, &request[1], QUERY_REQUEST_LENGTH - 1);
+        request_length = QUERY_REQUEST_LENGTH - 1;
+    }
+    return;
+}
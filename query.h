@@ -0,0 +1,55 @@
+/*
+ * query.h
+ *
+ *
+ * Request/response query protocol over UART, framing is similar to Modbus RTU:
+ *
+ * Request:  address, function, CRC low, CRC high
+ * Response: address, function, payload length, payload..., CRC low, CRC high
+ * Error:    address, function | 0x80, exception code, CRC low, CRC high
+ *
+ * CRC is Modbus CRC16 (polynomial 0xA001, initial value 0xFFFF). Multi-byte payload values are big endian.
+ */
+
+
+#ifndef QUERY_H_
+#define QUERY_H_
+
+#ifndef QUERY_NODE_ADDRESS
+#define QUERY_NODE_ADDRESS 1
+#endif
+
+#define QUERY_REQUEST_LENGTH 4
+#define QUERY_MAX_RESPONSE 32
+#define QUERY_BUS_DEVICES 4 /* Devices reported in bus statistics */
+#define QUERY_FRAME_GAP_TICKS 2 /* Partial request older than this (in 10ms system ticks) is discarded */
+
+/* Function codes */
+#define QUERY_LATEST_SAMPLE 0x41
+#define QUERY_STATISTICS 0x42
+#define QUERY_DIAGNOSTICS 0x43
+#define QUERY_BUS_STATISTICS 0x44
+#define QUERY_EXCEPTION 0x80
+
+/* Exception codes */
+#define QUERY_ILLEGAL_FUNCTION 0x01
+
+typedef struct
+{
+    uint8_t length;
+    uint8_t data[QUERY_MAX_RESPONSE];
+} query_response_t;
+
+/* Complete response frames, built by main program whenever cached data changes */
+typedef struct
+{
+    query_response_t latest_sample;
+    query_response_t statistics;
+    query_response_t diagnostics;
+    query_response_t bus_statistics;
+} query_response_set_t;
+
+void query_update_cache(void);
+void query_receive_byte(uint8_t data, uint8_t error);
+
+#endif /* QUERY_H_ */
@@ -0,0 +1,114 @@
+/*
+ * ring_buffer.c
+ *
+ *
+ * Producer side: ring_buffer_put(), ring_buffer_write()
+ * Consumer side: ring_buffer_get(), ring_buffer_read(), ring_buffer_discard()
+ *
+ * Multi-byte writes and reads move the index only once, after all bytes have been copied, so the other side
+ * sees either the whole record or nothing.
+ */
+
+#include <avr/io.h>
+
+#include "ring_buffer.h"
+
+uint8_t ring_buffer_count(const ring_buffer_t *ring)
+{
+    return (uint8_t)(ring->head - ring->tail);
+}
+
+uint8_t ring_buffer_free(const ring_buffer_t *ring)
+{
+    return (ring->mask + 1) - ring_buffer_count(ring);
+}
+
+/*
+ * Returns zero if buffer is full.
+ *
+ */
+uint8_t ring_buffer_put(ring_buffer_t *ring, uint8_t data)
+{
+    uint8_t head = ring->head;
+
+    if ((uint8_t)(head - ring->tail) > ring->mask)
+    {
+        return 0;
+    }
+    ring->data[head & ring->mask] = data;
+    RING_BUFFER_BARRIER();
+    ring->head = head + 1;
+    return 1;
+}
+
+/*
+ * Returns zero if buffer is empty.
+ *
+ */
+uint8_t ring_buffer_get(ring_buffer_t *ring, uint8_t *data)
+{
+    uint8_t tail = ring->tail;
+
+    if (ring->head == tail)
+    {
+        return 0;
+    }
+    *data = ring->data[tail & ring->mask];
+    RING_BUFFER_BARRIER();
+    ring->tail = tail + 1;
+    return 1;
+}
+
+/*
+ * Write a record of given length, or nothing if there is not enough room. Returns zero if nothing was written.
+ *
+ */
+uint8_t ring_buffer_write(ring_buffer_t *ring, const uint8_t *data, uint8_t length)
+{
+    uint8_t head = ring->head;
+    uint8_t i;
+
+    if ((uint8_t)((ring->mask + 1) - (uint8_t)(head - ring->tail)) < length)
+    {
+        return 0;
+    }
+    for (i = 0; i < length; i++)
+    {
+        ring->data[(uint8_t)(head + i) & ring->mask] = data[i];
+    }
+    RING_BUFFER_BARRIER();
+    ring->head = head + length;
+    return 1;
+}
+
+/*
+ * Read a record of given length, or nothing if there is not that much data. Returns zero if nothing was read.
+ *
+ */
+uint8_t ring_buffer_read(ring_buffer_t *ring, uint8_t *data, uint8_t length)
+{
+    uint8_t tail = ring->tail;
+    uint8_t i;
+
+    if ((uint8_t)(ring->head - tail) < length)
+    {
+        return 0;
+    }
+    for (i = 0; i < length; i++)
+    {
+        data[i] = ring->data[(uint8_t)(tail + i) & ring->mask];
+    }
+    RING_BUFFER_BARRIER();
+    ring->tail = tail + length;
+    return 1;
+}
+
+/*
+ * Drop everything currently in the buffer.
+ *
+ */
+void ring_buffer_discard(ring_buffer_t *ring)
+{
+    ring->tail = ring->head;
+    return;
+}
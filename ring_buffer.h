@@ -0,0 +1,45 @@
+/*
+ * ring_buffer.h
+ *
+ *
+ * Single producer, single consumer byte ring buffer for passing data between an ISR and main program.
+ *
+ * No locking is needed: head is written only by producer and tail only by consumer, and both are single bytes,
+ * which AVR reads and writes atomically. Indices run freely from 0 to 255, and buffer size is a power of two
+ * at most 128, so the number of stored bytes is always head - tail in 8-bit arithmetic.
+ */
+
+
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+typedef struct
+{
+    uint8_t *data;
+    uint8_t mask; /* Size - 1 */
+    volatile uint8_t head; /* Next byte to write, producer only */
+    volatile uint8_t tail; /* Next byte to read, consumer only */
+} ring_buffer_t;
+
+#define RING_BUFFER_SIZE_VALID(size) (((size) >= 2) && ((size) <= 128) && (((size) & ((size) - 1)) == 0))
+
+/*
+ * Define a ring buffer and its storage. Size is checked at compile time.
+ */
+#define RING_BUFFER_DEFINE(name, size) \
+    _Static_assert(RING_BUFFER_SIZE_VALID(size), "ring buffer size must be a power of two, 2-128"); \
+    uint8_t name##_storage[size]; \
+    ring_buffer_t name = {name##_storage, (size) - 1, 0, 0}
+
+/* Keep compiler from moving data accesses across an index update */
+#define RING_BUFFER_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+uint8_t ring_buffer_count(const ring_buffer_t *ring);
+uint8_t ring_buffer_free(const ring_buffer_t *ring);
+uint8_t ring_buffer_put(ring_buffer_t *ring, uint8_t data);
+uint8_t ring_buffer_get(ring_buffer_t *ring, uint8_t *data);
+uint8_t ring_buffer_write(ring_buffer_t *ring, const uint8_t *data, uint8_t length);
+uint8_t ring_buffer_read(ring_buffer_t *ring, uint8_t *data, uint8_t length);
+void ring_buffer_discard(ring_buffer_t *ring);
+
+#endif /* RING_BUFFER_H_ */
@@ -0,0 +1,88 @@
+/*
+ * am2301_model.c
+ *
+ * Frame is 40 data bits, MSB first: humidity, temperature and parity (sum of the four data bytes). Each bit is
+ * a low period followed by a high period whose length tells the bit value, so the input capture sees one falling
+ * edge for the response and one at the beginning of each bit, and a last one when the sensor releases the line.
+ *
+ * Low pulses shorter than AM2301_MODEL_START_MIN_NS (e.g. a glitch when the line is switched back to output)
+ * are not start pulses, and they are ignored.
+ */
+
+#include <string.h>
+
+#include "mcu_sim.h"
+#include "am2301_model.h"
+
+void am2301_model_init(am2301_model_t *sensor, uint16_t humidity, uint16_t temperature)
+{
+    memset(sensor, 0, sizeof(*sensor));
+    sensor->humidity = humidity;
+    sensor->temperature = temperature;
+    return;
+}
+
+static void send_frame(am2301_model_t *sensor, uint64_t time_ns)
+{
+    uint8_t bytes[5];
+    uint8_t i;
+    uint8_t bit;
+
+    if (sensor->powered_up)
+    {
+        bytes[0] = sensor->humidity >> 8;
+        bytes[1] = sensor->humidity & 0xff;
+        bytes[2] = sensor->temperature >> 8;
+        bytes[3] = sensor->temperature & 0xff;
+        bytes[4] = bytes[0] + bytes[1] + bytes[2] + bytes[3];
+    }
+    else
+    {
+        /* Nothing has been measured yet */
+        memset(bytes, 0, sizeof(bytes));
+        bytes[4] = 0xff;
+        sensor->powered_up = 1;
+    }
+
+    time_ns += AM2301_MODEL_GO_NS;
+    sim_icp1_falling_edge(time_ns);
+    time_ns += AM2301_MODEL_RESPONSE_LOW_NS + AM2301_MODEL_RESPONSE_HIGH_NS;
+    sim_icp1_falling_edge(time_ns);
+    for (i = 0; i < AM2301_MODEL_DATA_BITS + AM2301_MODEL_EXTRA_BITS; i++)
+    {
+        bit = (i < AM2301_MODEL_DATA_BITS) ? (bytes[i / 8] >> (7 - (i % 8))) & 1 : 0;
+        time_ns += AM2301_MODEL_BIT_LOW_NS + (bit ? AM2301_MODEL_ONE_HIGH_NS : AM2301_MODEL_ZERO_HIGH_NS);
+        sim_icp1_falling_edge(time_ns);
+    }
+    sensor->frames++;
+    return;
+}
+
+void am2301_model_pin_change(void *context, uint8_t low, uint64_t time_ns)
+{
+    am2301_model_t *sensor = context;
+    uint64_t pulse_ns;
+
+    if (low)
+    {
+        sensor->low_since_ns = time_ns;
+        return;
+    }
+    pulse_ns = time_ns - sensor->low_since_ns;
+    if (pulse_ns < AM2301_MODEL_START_MIN_NS)
+    {
+        return;
+    }
+    if (pulse_ns > sensor->longest_start_pulse_ns)
+    {
+        sensor->longest_start_pulse_ns = pulse_ns;
+    }
+    if (pulse_ns > AM2301_MODEL_START_MAX_NS)
+    {
+        sensor->long_start_pulses++;
+        return;
+    }
+    sensor->last_frame_ns = time_ns;
+    send_frame(sensor, time_ns);
+    return;
+}
@@ -0,0 +1,42 @@
+/*
+ * am2301_model.h
+ *
+ * Model of an AM2301 (DHT21) sensor on the input capture pin. Host start pulse is checked, and the response frame
+ * is given as falling edges to the simulated input capture, with datasheet typical timing.
+ */
+
+
+#ifndef AM2301_MODEL_H_
+#define AM2301_MODEL_H_
+
+#include <stdint.h>
+
+/* Timing from AM2301 datasheet, typical values */
+#define AM2301_MODEL_START_MIN_NS 800000ULL /* Host start pulse accepted 0,8-20ms */
+#define AM2301_MODEL_START_MAX_NS 20000000ULL
+#define AM2301_MODEL_GO_NS 30000ULL /* From host release to response */
+#define AM2301_MODEL_RESPONSE_LOW_NS 80000ULL
+#define AM2301_MODEL_RESPONSE_HIGH_NS 80000ULL
+#define AM2301_MODEL_BIT_LOW_NS 50000ULL
+#define AM2301_MODEL_ZERO_HIGH_NS 26000ULL
+#define AM2301_MODEL_ONE_HIGH_NS 70000ULL
+#define AM2301_MODEL_DATA_BITS 40
+#define AM2301_MODEL_EXTRA_BITS 25 /* Trailing zero bits, the sensor in use sends 65 bits */
+
+typedef struct
+{
+    uint16_t humidity; /* AM2301 format, 0,1 units */
+    uint16_t temperature; /* AM2301 format, MSB set means negative */
+    uint8_t powered_up; /* First frame after power-on has been sent, it is trash */
+    uint64_t low_since_ns; /* Host started start pulse */
+
+    uint32_t frames;
+    uint32_t long_start_pulses; /* Over AM2301_MODEL_START_MAX_NS, not answered */
+    uint64_t longest_start_pulse_ns;
+    uint64_t last_frame_ns; /* Host released the line for the latest answered frame */
+} am2301_model_t;
+
+void am2301_model_init(am2301_model_t *sensor, uint16_t humidity, uint16_t temperature);
+void am2301_model_pin_change(void *context, uint8_t low, uint64_t time_ns);
+
+#endif /* AM2301_MODEL_H_ */
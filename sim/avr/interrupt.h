@@ -0,0 +1,18 @@
+/*
+ * interrupt.h
+ *
+ * Host simulation replacement of <avr/interrupt.h>. Interrupt handlers become ordinary functions,
+ * which the simulated peripherals call when global interrupts are enabled.
+ */
+
+
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#include "mcu_sim.h"
+
+#define ISR(vector) void vector(void)
+#define sei() sim_enable_interrupts()
+#define cli() sim_disable_interrupts()
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
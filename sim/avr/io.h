@@ -0,0 +1,99 @@
+/*
+ * io.h
+ *
+ * Host simulation replacement of <avr/io.h>. Every access of an ATmega328P register goes through
+ * sim_io8()/sim_io16(), which let simulated time advance before returning the register, so polling
+ * loops see the peripherals progress exactly as on target.
+ */
+
+
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+volatile uint8_t *sim_io8(volatile uint8_t *reg);
+volatile uint16_t *sim_io16(volatile uint16_t *reg);
+
+extern volatile uint8_t sim_reg_SREG, sim_reg_DDRB, sim_reg_PORTB, sim_reg_PINB, sim_reg_DDRC, sim_reg_PORTC, sim_reg_PINC;
+extern volatile uint8_t sim_reg_TCCR1A, sim_reg_TCCR1B, sim_reg_TIMSK1, sim_reg_TIFR1;
+extern volatile uint8_t sim_reg_TWBR, sim_reg_TWSR, sim_reg_TWCR, sim_reg_TWDR;
+extern volatile uint8_t sim_reg_UCSR0A, sim_reg_UCSR0B, sim_reg_UCSR0C, sim_reg_UDR0, sim_reg_UBRR0H, sim_reg_UBRR0L;
+extern volatile uint16_t sim_reg_TCNT1, sim_reg_OCR1A, sim_reg_ICR1;
+
+#define SREG (*sim_io8(&sim_reg_SREG))
+#define DDRB (*sim_io8(&sim_reg_DDRB))
+#define PORTB (*sim_io8(&sim_reg_PORTB))
+#define PINB (*sim_io8(&sim_reg_PINB))
+#define DDRC (*sim_io8(&sim_reg_DDRC))
+#define PORTC (*sim_io8(&sim_reg_PORTC))
+#define PINC (*sim_io8(&sim_reg_PINC))
+#define TCCR1A (*sim_io8(&sim_reg_TCCR1A))
+#define TCCR1B (*sim_io8(&sim_reg_TCCR1B))
+#define TIMSK1 (*sim_io8(&sim_reg_TIMSK1))
+#define TIFR1 (*sim_io8(&sim_reg_TIFR1))
+#define TWBR (*sim_io8(&sim_reg_TWBR))
+#define TWSR (*sim_io8(&sim_reg_TWSR))
+#define TWCR (*sim_io8(&sim_reg_TWCR))
+#define TWDR (*sim_io8(&sim_reg_TWDR))
+#define UCSR0A (*sim_io8(&sim_reg_UCSR0A))
+#define UCSR0B (*sim_io8(&sim_reg_UCSR0B))
+#define UCSR0C (*sim_io8(&sim_reg_UCSR0C))
+#define UDR0 (*sim_io8(&sim_reg_UDR0))
+#define UBRR0H (*sim_io8(&sim_reg_UBRR0H))
+#define UBRR0L (*sim_io8(&sim_reg_UBRR0L))
+#define TCNT1 (*sim_io16(&sim_reg_TCNT1))
+#define OCR1A (*sim_io16(&sim_reg_OCR1A))
+#define ICR1 (*sim_io16(&sim_reg_ICR1))
+
+/* TCCR1A */
+#define COM1A1 7
+#define COM1A0 6
+#define WGM11 1
+#define WGM10 0
+/* TCCR1B */
+#define ICNC1 7
+#define ICES1 6
+#define WGM13 4
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+/* TIMSK1, TIFR1 */
+#define ICIE1 5
+#define ICF1 5
+#define OCIE1A 1
+#define OCF1A 1
+/* TWCR */
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+/* TWSR */
+#define TWPS1 1
+#define TWPS0 0
+/* UCSR0A, UCSR0B, UCSR0C */
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+/* Port pins */
+#define PB0 0
+#define PC4 4
+#define PC5 5
+
+#endif /* SIM_AVR_IO_H_ */
@@ -0,0 +1,20 @@
+/*
+ * pgmspace.h
+ *
+ * Host simulation replacement of <avr/pgmspace.h>. Host has one address space, so flash data is ordinary
+ * constant data and the read functions are plain memory reads.
+ */
+
+
+#ifndef SIM_AVR_PGMSPACE_H_
+#define SIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define snprintf_P snprintf
+
+#endif /* SIM_AVR_PGMSPACE_H_ */
@@ -0,0 +1,17 @@
+/*
+ * sleep.h
+ *
+ * Host simulation replacement of <avr/sleep.h>. Sleeping waits for the next simulated interrupt.
+ */
+
+
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+#include "mcu_sim.h"
+
+#define SLEEP_MODE_IDLE 0
+#define set_sleep_mode(mode)
+#define sleep_mode() sim_sleep()
+
+#endif /* SIM_AVR_SLEEP_H_ */
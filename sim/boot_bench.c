@@ -0,0 +1,92 @@
+/*
+ * boot_bench.c
+ *
+ * Start-up benchmark on host: firmware start-up (main.c up to boot()) runs against simulated TWI with
+ * a PCF8574/HD44780 model at 0x27 and an AM2301 model on the input capture pin, and the time from boot to
+ * the first valid sample is reported in simulated time. main.c is compiled with -Dmain=firmware_main,
+ * so its endless loop is not run. Exit status is non-zero if there was no valid sample, sensor start
+ * pulse was too long or the display saw a controller timing violation.
+ *
+ * Build and run in sim directory: make boot_bench && ./boot_bench
+ */
+
+#include <stdio.h>
+
+#include <avr/io.h>
+#include "mcu_sim.h"
+#include "hd44780_model.h"
+#include "am2301_model.h"
+#include "i2c.h"
+#include "i2c_bus.h"
+#include "lcd_with_i2c.h"
+#include "timer.h"
+#include "am2301.h"
+#include "uart.h"
+#include "query.h"
+
+#define BENCH_HUMIDITY 456 /* 45,6 % */
+#define BENCH_TEMPERATURE 231 /* 23,1 C */
+
+uint32_t boot(void);
+void show_measurement(void);
+
+int main(void)
+{
+    hd44780_model_t display;
+    am2301_model_t sensor;
+    am2301_sample_t sample;
+    char line[HD44780_LINE_LENGTH + 1];
+    uint32_t first_read_time, first_valid_time;
+    uint8_t i, failed = 0;
+
+    hd44780_model_init(&display);
+    sim_add_i2c_slave(0x27, hd44780_model_write, &display);
+    am2301_model_init(&sensor, BENCH_HUMIDITY, BENCH_TEMPERATURE);
+    sim_attach_icp1(am2301_model_pin_change, &sensor);
+
+    /* Same start-up as main() */
+    sim_start();
+    SREG |= 128;
+    init_timer();
+    init_uart();
+    query_update_cache();
+    init_twi();
+    i2c_bus_scan(I2C_BUS_FIRST_ADDRESS, I2C_BUS_LAST_ADDRESS);
+    lcd_attach_detected();
+    first_read_time = boot();
+    show_measurement();
+    sim_stop();
+
+    first_valid_time = get_am2301_first_valid_time();
+    get_am2301_sample(&sample);
+    printf("First measurement started     %10.1f ms\n", first_read_time / 1000.0);
+    printf("First valid sample            %10.1f ms\n", first_valid_time / 1000.0);
+    printf("Sensor: %u frames, longest start pulse %.2f ms, %u too long\n", sensor.frames,
+           sensor.longest_start_pulse_ns / 1000000.0, sensor.long_start_pulses);
+    printf("Sample: humidity %u, temperature %u, validity %u\n", sample.humidity_int, sample.temperature_int,
+           sample.data_validity);
+    printf("Display: %u instructions, %u data writes, %u timing violations\n", display.instructions,
+           display.data_writes, display.busy_violations);
+    for (i = 0; i < 2; i++)
+    {
+        hd44780_model_visible_line(&display, i, 16, line);
+        printf("  |%s|\n", line);
+    }
+
+    if ((first_valid_time == 0) || (sample.humidity_int != BENCH_HUMIDITY) || (sample.temperature_int != BENCH_TEMPERATURE))
+    {
+        printf("FAIL: no valid sample\n");
+        failed = 1;
+    }
+    if (sensor.long_start_pulses > 0)
+    {
+        printf("FAIL: start pulse over %.0f ms\n", AM2301_MODEL_START_MAX_NS / 1000000.0);
+        failed = 1;
+    }
+    if (display.busy_violations > 0)
+    {
+        printf("FAIL: %s\n", display.last_violation);
+        failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,244 @@
+/*
+ * hd44780_model.c
+ *
+ * The expander updates its outputs when it acknowledges a data byte. HD44780 latches D7..D4, RS and RW
+ * on the falling edge of EN, so an instruction is decoded from EN high -> low transitions of consecutive
+ * expander bytes. After power-on the controller is in 8-bit mode, where each strobe is a complete
+ * instruction with D3..D0 reading as zero.
+ *
+ * Every instruction is checked against controller busy time of the previous one. In 4-bit mode the check
+ * is done at the first nibble, because controller does not accept any part of an instruction while busy.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hd44780_model.h"
+
+#define EXPANDER_EN 0x04
+#define EXPANDER_RW 0x02
+#define EXPANDER_RS 0x01
+
+void hd44780_model_init(hd44780_model_t *lcd)
+{
+    memset(lcd, 0, sizeof(*lcd));
+    memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+    lcd->increment = 1;
+    lcd->busy_until_ns = HD44780_POWER_ON_NS;
+    return;
+}
+
+static void check_busy(hd44780_model_t *lcd, uint8_t rs, uint8_t data, uint64_t time_ns)
+{
+    if (time_ns < lcd->busy_until_ns)
+    {
+        lcd->busy_violations++;
+        snprintf(lcd->last_violation, sizeof(lcd->last_violation),
+                 "%s 0x%02x at %llu us, busy for %llu us more",
+                 rs ? "data" : "instruction", data,
+                 (unsigned long long)(time_ns / 1000),
+                 (unsigned long long)((lcd->busy_until_ns - time_ns + 999) / 1000));
+    }
+    return;
+}
+
+static void set_busy(hd44780_model_t *lcd, uint64_t time_ns, uint64_t duration_ns)
+{
+    lcd->busy_until_ns = time_ns + duration_ns;
+    lcd->busy_ns += duration_ns;
+    return;
+}
+
+static void move_address_counter(hd44780_model_t *lcd)
+{
+    if (lcd->cgram_selected)
+    {
+        lcd->address_counter = (lcd->address_counter + (lcd->increment ? 1 : -1)) & (HD44780_CGRAM_SIZE - 1);
+        return;
+    }
+    if (lcd->increment)
+    {
+        lcd->address_counter++;
+        if (lcd->address_counter == 0x28) lcd->address_counter = 0x40;
+        else if (lcd->address_counter == 0x68) lcd->address_counter = 0x00;
+    }
+    else
+    {
+        if (lcd->address_counter == 0x00) lcd->address_counter = 0x67;
+        else if (lcd->address_counter == 0x40) lcd->address_counter = 0x27;
+        else lcd->address_counter--;
+    }
+    return;
+}
+
+static void shift_display(hd44780_model_t *lcd, uint8_t left)
+{
+    lcd->display_shift = (lcd->display_shift + (left ? 1 : HD44780_LINE_LENGTH - 1)) % HD44780_LINE_LENGTH;
+    return;
+}
+
+static void execute_instruction(hd44780_model_t *lcd, uint8_t data, uint64_t time_ns)
+{
+    uint64_t duration = HD44780_COMMAND_NS;
+
+    lcd->instructions++;
+    if (data & 0x80)
+    {
+        /* Set DDRAM address */
+        lcd->address_counter = data & 0x7f;
+        lcd->cgram_selected = 0;
+    }
+    else if (data & 0x40)
+    {
+        /* Set CGRAM address */
+        lcd->address_counter = data & 0x3f;
+        lcd->cgram_selected = 1;
+    }
+    else if (data & 0x20)
+    {
+        /* Function set */
+        if (!lcd->four_bit_mode && (data & 0x10))
+        {
+            lcd->init_function_sets++;
+            if (lcd->init_function_sets == 1) duration = HD44780_FIRST_INIT_NS;
+            else if (lcd->init_function_sets == 2) duration = HD44780_SECOND_INIT_NS;
+        }
+        lcd->four_bit_mode = !(data & 0x10);
+        lcd->two_lines = (data & 0x08) != 0;
+    }
+    else if (data & 0x10)
+    {
+        /* Cursor or display shift */
+        if (data & 0x08)
+        {
+            shift_display(lcd, !(data & 0x04));
+        }
+        else if (data & 0x04)
+        {
+            lcd->increment = 1;
+            move_address_counter(lcd);
+        }
+        else
+        {
+            lcd->increment = 0;
+            move_address_counter(lcd);
+        }
+    }
+    else if (data & 0x08)
+    {
+        /* Display on/off control */
+        lcd->display_on = (data & 0x04) != 0;
+    }
+    else if (data & 0x04)
+    {
+        /* Entry mode set */
+        lcd->increment = (data & 0x02) != 0;
+        lcd->entry_shift = data & 0x01;
+    }
+    else if (data & 0x02)
+    {
+        /* Return home */
+        lcd->address_counter = 0;
+        lcd->cgram_selected = 0;
+        lcd->display_shift = 0;
+        duration = HD44780_CLEAR_NS;
+    }
+    else if (data & 0x01)
+    {
+        /* Clear display */
+        memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+        lcd->address_counter = 0;
+        lcd->cgram_selected = 0;
+        lcd->display_shift = 0;
+        lcd->increment = 1;
+        duration = HD44780_CLEAR_NS;
+    }
+    set_busy(lcd, time_ns, duration);
+    return;
+}
+
+static void write_data(hd44780_model_t *lcd, uint8_t data, uint64_t time_ns)
+{
+    uint8_t increment = lcd->increment;
+
+    lcd->data_writes++;
+    if (lcd->cgram_selected)
+    {
+        lcd->cgram[lcd->address_counter & (HD44780_CGRAM_SIZE - 1)] = data;
+    }
+    else
+    {
+        lcd->ddram[lcd->address_counter & (HD44780_DDRAM_SIZE - 1)] = data;
+        if (lcd->entry_shift) shift_display(lcd, increment);
+    }
+    move_address_counter(lcd);
+    set_busy(lcd, time_ns, HD44780_DATA_NS);
+    return;
+}
+
+/*
+ * EN falling edge, latch a nibble (or an 8-bit mode instruction) from expander outputs while EN was high.
+ *
+ */
+static void strobe(hd44780_model_t *lcd, uint8_t latched, uint64_t time_ns)
+{
+    uint8_t rs = latched & EXPANDER_RS;
+    uint8_t data;
+
+    if (latched & EXPANDER_RW)
+    {
+        /* Read cycles are not modeled, and they do not disturb nibble pairing if ignored */
+        lcd->unsupported++;
+        return;
+    }
+    if (!lcd->four_bit_mode)
+    {
+        data = latched & 0xf0;
+        check_busy(lcd, rs, data, time_ns);
+        if (rs) write_data(lcd, data, time_ns);
+        else execute_instruction(lcd, data, time_ns);
+        return;
+    }
+    if (!lcd->nibble_pending)
+    {
+        check_busy(lcd, rs, latched & 0xf0, time_ns);
+        lcd->high_nibble = latched & 0xf0;
+        lcd->nibble_pending = 1;
+        return;
+    }
+    lcd->nibble_pending = 0;
+    data = lcd->high_nibble | (latched >> 4);
+    if (rs) write_data(lcd, data, time_ns);
+    else execute_instruction(lcd, data, time_ns);
+    return;
+}
+
+void hd44780_model_write(void *context, uint8_t data, uint64_t time_ns)
+{
+    hd44780_model_t *lcd = (hd44780_model_t *)context;
+    uint8_t previous = lcd->expander_output;
+
+    lcd->expander_output = data;
+    if ((previous & EXPANDER_EN) && !(data & EXPANDER_EN))
+    {
+        strobe(lcd, previous, time_ns);
+    }
+    return;
+}
+
+/*
+ * Text visible on given row, taking display shift into account. Non-printable characters are shown as '?'.
+ *
+ */
+void hd44780_model_visible_line(const hd44780_model_t *lcd, uint8_t row, uint8_t columns, char *buffer)
+{
+    uint8_t column, chr;
+
+    for (column = 0; column < columns; column++)
+    {
+        chr = lcd->ddram[(row ? 0x40 : 0x00) + (column + lcd->display_shift) % HD44780_LINE_LENGTH];
+        buffer[column] = ((chr >= 0x20) && (chr < 0x7f)) ? chr : '?';
+    }
+    buffer[columns] = 0;
+    return;
+}
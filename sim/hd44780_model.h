@@ -0,0 +1,57 @@
+/*
+ * hd44780_model.h
+ *
+ * Model of a PCF8574 I2C expander driving an HD44780 controller in 4-bit mode, wired as in lcd_with_i2c.c:
+ * expander bits 7..4 are D7..D4, bit 3 backlight, bit 2 EN, bit 1 RW and bit 0 RS.
+ */
+
+
+#ifndef HD44780_MODEL_H_
+#define HD44780_MODEL_H_
+
+#include <stdint.h>
+
+#define HD44780_DDRAM_SIZE 0x80
+#define HD44780_CGRAM_SIZE 0x40
+#define HD44780_LINE_LENGTH 40
+
+/* Execution times from HD44780 datasheet (fosc 270kHz) */
+#define HD44780_POWER_ON_NS 40000000ULL
+#define HD44780_CLEAR_NS 1520000ULL
+#define HD44780_COMMAND_NS 37000ULL
+#define HD44780_DATA_NS 41000ULL
+#define HD44780_FIRST_INIT_NS 4100000ULL
+#define HD44780_SECOND_INIT_NS 100000ULL
+
+typedef struct
+{
+    uint8_t expander_output;
+    uint8_t four_bit_mode;
+    uint8_t nibble_pending; /* 4-bit mode: high nibble received, waiting for low nibble */
+    uint8_t high_nibble;
+    uint8_t init_function_sets; /* 8-bit function sets received, for "initialising by instruction" */
+
+    uint8_t ddram[HD44780_DDRAM_SIZE];
+    uint8_t cgram[HD44780_CGRAM_SIZE];
+    uint8_t address_counter;
+    uint8_t cgram_selected;
+    uint8_t increment;
+    uint8_t entry_shift;
+    uint8_t display_on;
+    uint8_t two_lines;
+    uint8_t display_shift; /* 0..39, positive is shifted left */
+
+    uint64_t busy_until_ns;
+    uint64_t busy_ns; /* Total controller execution time */
+    uint32_t instructions;
+    uint32_t data_writes;
+    uint32_t busy_violations;
+    uint32_t unsupported; /* Reads, which this model does not implement */
+    char last_violation[96];
+} hd44780_model_t;
+
+void hd44780_model_init(hd44780_model_t *lcd);
+void hd44780_model_write(void *context, uint8_t data, uint64_t time_ns);
+void hd44780_model_visible_line(const hd44780_model_t *lcd, uint8_t row, uint8_t columns, char *buffer);
+
+#endif /* HD44780_MODEL_H_ */
@@ -0,0 +1,213 @@
+/*
+ * lcd_bench.c
+ *
+ * Display path benchmark on host: the real TWI driver, bus manager and LCD driver run against simulated
+ * TWI hardware and PCF8574/HD44780 models, and bus cost of each LCD operation is reported in simulated time.
+ * Exit status is non-zero if any display saw a controller timing violation or showed wrong text.
+ *
+ * Build and run in sim directory: make lcd_bench && ./lcd_bench [display address in hex[/max rate in kbit/s] ...]
+ *
+ * Default is one display at 0x27. Build with DEFS=-DTWI_BIT_RATE=400000UL for fast mode. A display
+ * given a max rate does not answer faster bus, e.g. "27 26/100" has a standard mode only display at 0x26.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include "mcu_sim.h"
+#include "hd44780_model.h"
+#include "i2c.h"
+#include "i2c_bus.h"
+#include "lcd_with_i2c.h"
+#include "timer.h"
+
+#define MAX_MODELS 2
+
+typedef struct
+{
+    sim_twi_stats_t bus;
+    twi_error_counters_t twi_errors;
+    i2c_device_counters_t device_counters;
+    uint64_t time_ns;
+    uint32_t instructions;
+    uint32_t violations;
+} bench_snapshot_t;
+
+extern i2c_device_t i2c_devices[];
+extern i2c_lcd_data_t lcd_displays[];
+
+hd44780_model_t models[MAX_MODELS];
+uint8_t model_addresses[MAX_MODELS];
+uint8_t model_count = 0;
+
+void take_snapshot(bench_snapshot_t *snapshot)
+{
+    uint8_t i;
+
+    sim_get_twi_stats(&snapshot->bus);
+    snapshot->time_ns = sim_time_ns();
+    snapshot->instructions = 0;
+    snapshot->violations = 0;
+    for (i = 0; i < model_count; i++)
+    {
+        snapshot->instructions += models[i].instructions + models[i].data_writes;
+        snapshot->violations += models[i].busy_violations;
+    }
+    return;
+}
+
+void report(const char *operation, const bench_snapshot_t *before)
+{
+    bench_snapshot_t after;
+
+    take_snapshot(&after);
+    printf("%-28s %6u %6u %6u %10.1f %11.1f %6u %6u\n", operation,
+           after.bus.starts - before->bus.starts,
+           after.bus.stops - before->bus.stops,
+           after.bus.bytes - before->bus.bytes,
+           (after.bus.bus_ns - before->bus.bus_ns) / 1000.0,
+           (after.time_ns - before->time_ns) / 1000.0,
+           after.instructions - before->instructions,
+           after.violations - before->violations);
+    return;
+}
+
+void wait_online(uint8_t device)
+{
+    i2c_device_counters_t counters;
+
+    do
+    {
+        i2c_bus_service();
+        i2c_bus_get_device_counters(device, &counters);
+    } while (!counters.online);
+    return;
+}
+
+/*
+ * Check that the display written by the LCD driver shows given text at the beginning of a row.
+ * Returns number of mismatches.
+ *
+ */
+uint32_t check_visible_text(uint8_t row, const char *text)
+{
+    char line[HD44780_LINE_LENGTH + 1];
+    uint8_t address = i2c_bus_device_address(lcd_displays[0].device);
+    uint8_t display;
+
+    for (display = 0; display < model_count; display++)
+    {
+        if (model_addresses[display] != address) continue;
+        hd44780_model_visible_line(&models[display], row, 16, line);
+        if (strncmp(line, text, strlen(text)) != 0)
+        {
+            printf("Display %u row %u: |%s|, expected |%s|\n", display, row, line, text);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#define MEASURE(operation, statement) \
+    do { bench_snapshot_t before; take_snapshot(&before); statement; report(operation, &before); } while (0)
+
+int main(int argc, char *argv[])
+{
+    char line[HD44780_LINE_LENGTH + 1];
+    uint8_t i, display;
+    uint32_t violations = 0;
+    sim_twi_stats_t bus;
+    twi_error_counters_t twi_errors;
+    i2c_device_counters_t device_counters;
+
+    for (i = 1; (i < argc) && (model_count < MAX_MODELS); i++)
+    {
+        char *end;
+        uint8_t address = strtoul(argv[i], &end, 16);
+
+        hd44780_model_init(&models[model_count]);
+        sim_add_i2c_slave(address, hd44780_model_write, &models[model_count]);
+        model_addresses[model_count] = address;
+        if (*end == '/')
+        {
+            sim_set_i2c_slave_max_rate(address, strtoul(end + 1, NULL, 10) * 1000);
+        }
+        model_count++;
+    }
+    if (model_count == 0)
+    {
+        hd44780_model_init(&models[0]);
+        sim_add_i2c_slave(0x27, hd44780_model_write, &models[0]);
+        model_addresses[0] = 0x27;
+        model_count = 1;
+    }
+
+    sim_start();
+    SREG |= 128;
+    init_timer();
+    init_twi();
+
+    printf("%-28s %6s %6s %6s %10s %11s %6s %6s\n", "operation", "START", "STOP", "bytes",
+           "bus us", "elapsed us", "instr", "viol");
+    MEASURE("i2c_bus_scan", i2c_bus_scan(I2C_BUS_FIRST_ADDRESS, I2C_BUS_LAST_ADDRESS));
+    MEASURE("lcd_attach_detected", lcd_attach_detected());
+    MEASURE("init_lcd", init_lcd());
+    MEASURE("lcd_clear_screen", lcd_clear_screen());
+    MEASURE("lcd_write_string, 16 chars", lcd_write_string(0, 0, "Temp: 23.4 \xdf" "C   "));
+    MEASURE("lcd_write_string, 7 chars", lcd_write_string(1, 0, "Wait..."));
+    i2c_bus_hold(get_microseconds() + 5000);
+    MEASURE("lcd_write_string, held 5ms", lcd_write_string(1, 0, "Held..."));
+    MEASURE("change_lcd_backlight", change_lcd_backlight(1));
+    MEASURE("lcd_write_marquee, 40 chars", lcd_write_marquee(0, "Marquee: status text longer than display"));
+    MEASURE("lcd_marquee_step", lcd_marquee_step());
+    MEASURE("lcd_marquee_step", lcd_marquee_step());
+    MEASURE("lcd_write_string, shifted", lcd_write_string(1, 0, "Shifted"));
+    violations += check_visible_text(1, "Shifted");
+    while (lcd_displays[0].display_shift < 30)
+    {
+        lcd_marquee_step();
+    }
+    MEASURE("lcd_write_string, row wraps", lcd_write_string(1, 2, "DDRAM wraps"));
+    violations += check_visible_text(1, "  DDRAM wraps");
+    lcd_marquee_reset();
+    sim_set_twi_fault(1, 5);
+    MEASURE("lcd_write_string, bus hung", lcd_write_string(1, 0, "Hung..."));
+    sim_set_twi_fault(0, 0);
+    MEASURE("lcd_write_string, offline", lcd_write_string(1, 0, "Offline"));
+    delay_microseconds(1);
+    MEASURE("wait for reprobe", delay_seconds(6); wait_online(0));
+    MEASURE("lcd_write_string, back online", lcd_write_string(1, 0, "Online "));
+    sim_stop();
+
+    sim_get_twi_stats(&bus);
+    get_twi_error_counters(&twi_errors);
+    printf("\nTotal: %u NACKs, %u TWI interrupt retriggers\n", bus.nacks, bus.isr_retriggers);
+    printf("TWI errors: %u NACKs, %u bus errors, %u timeouts, %u recoveries, %u stuck\n", twi_errors.nacks,
+           twi_errors.bus_errors, twi_errors.timeouts, twi_errors.recoveries, twi_errors.stuck_bus);
+    for (i = 0; i < i2c_bus_device_count(); i++)
+    {
+        i2c_bus_get_device_counters(i, &device_counters);
+        printf("Device 0x%02x: %s, %s rate, %u transfers, %u retries, %u dropped\n", i2c_bus_device_address(i),
+               device_counters.online ? "online" : "offline", (i2c_devices[i].rate == TWI_RATE_DEFAULT) ? "default" : "fallback",
+               device_counters.transfers, device_counters.retries, device_counters.errors);
+    }
+    for (display = 0; display < model_count; display++)
+    {
+        printf("Display %u: %u instructions, %u data writes, %.1f us busy, %u timing violations\n", display,
+               models[display].instructions, models[display].data_writes, models[display].busy_ns / 1000.0,
+               models[display].busy_violations);
+        if (models[display].busy_violations > 0)
+        {
+            printf("  last: %s\n", models[display].last_violation);
+        }
+        for (i = 0; i < 2; i++)
+        {
+            hd44780_model_visible_line(&models[display], i, 16, line);
+            printf("  |%s|\n", line);
+        }
+        violations += models[display].busy_violations;
+    }
+    return (violations > 0) ? 1 : 0;
+}
@@ -0,0 +1,506 @@
+/*
+ * mcu_sim.c
+ *
+ * Peripheral models behind the simulated registers.
+ *
+ * Time advances by SIM_STEP_NS whenever application code accesses a register or calls a function,
+ * which is a rough model of CPU time. Bus and delay timings are exact, they come from peripheral models.
+ *
+ * TWI: a write into sim_reg_TWCR with TWINT set starts the requested bus operation (START, byte or STOP),
+ * which takes the same bus time as on target with the configured bit rate. When the operation is done,
+ * sim_reg_TWSR gets the status code and TWINT is set, which triggers TWI_vect. sim_reg_TWCR bit 1 is reserved on target,
+ * here it marks "TWINT set by hardware", so a later write by software can be told apart from it.
+ *
+ * Timer1: counts with prescaler from sim_reg_TCCR1B and clears at sim_reg_OCR1A (CTC mode), calling TIMER1_COMPA_vect.
+ *
+ * I2C pins (PC4 SDA, PC5 SCL) when TWI is disabled: a pin configured as input reads high (external pull-up),
+ * output reads low. A slave stuck in the middle of a byte can be simulated, it holds SDA low for the given
+ * number of SCL clocks. Clearing TWEN aborts the ongoing TWI operation, as on target.
+ *
+ * Input capture (ICP1, PB0): a device model attached with sim_attach_icp1() is told when the MCU starts and stops
+ * driving the pin low, and it schedules falling edges with sim_icp1_falling_edge(). At an edge sim_reg_ICR1 gets
+ * timer value and ICF1 is set, which triggers TIMER1_CAPT_vect. Flags in TIFR1 are cleared by writing one on target,
+ * and read-modify-write of sim_reg_TIFR1 cannot be told apart from that, so ICF1 is owned by the simulation: writes
+ * to it are ignored, and edges are captured only while the capture interrupt is enabled. Firmware clears ICF1 when
+ * enabling the interrupt, so it sees the same.
+ */
+
+#include <string.h>
+
+#include <avr/io.h>
+#include "mcu_sim.h"
+
+void TWI_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_CAPT_vect(void) __attribute__((weak));
+
+volatile uint8_t sim_reg_SREG, sim_reg_DDRB, sim_reg_PORTB, sim_reg_PINB, sim_reg_DDRC, sim_reg_PORTC, sim_reg_PINC;
+volatile uint8_t sim_reg_TCCR1A, sim_reg_TCCR1B, sim_reg_TIMSK1, sim_reg_TIFR1;
+volatile uint8_t sim_reg_TWBR, sim_reg_TWSR = 0xf8, sim_reg_TWCR, sim_reg_TWDR;
+volatile uint8_t sim_reg_UCSR0A, sim_reg_UCSR0B, sim_reg_UCSR0C, sim_reg_UDR0, sim_reg_UBRR0H, sim_reg_UBRR0L;
+volatile uint16_t sim_reg_TCNT1, sim_reg_OCR1A, sim_reg_ICR1;
+
+#define TWCR_HW_TWINT 0x02 /* Reserved bit, see above */
+
+typedef enum
+{
+    TWI_IDLE = 0,
+    TWI_START,
+    TWI_BYTE,
+    TWI_STOP
+} sim_twi_operation_t;
+
+typedef struct
+{
+    uint8_t address;
+    sim_i2c_slave_write_t write;
+    void *context;
+    uint32_t max_rate; /* Bits per second, zero means no limit */
+} sim_i2c_slave_t;
+
+static uint64_t now_ns;
+static uint8_t running;
+static uint8_t in_step; /* Peripheral or interrupt handler code is running, time does not advance */
+static uint32_t interrupts_taken;
+static uint64_t timer1_remainder; /* Timer1 prescaler fraction, in F_CPU cycles * 1e9 */
+
+static sim_twi_operation_t twi_operation;
+static uint64_t twi_done_ns;
+static uint8_t twi_bus_owned;
+static uint8_t twi_address_phase;
+static sim_i2c_slave_t *twi_slave;
+static sim_twi_stats_t twi_stats;
+
+static sim_i2c_slave_t slaves[SIM_MAX_I2C_SLAVES];
+static uint8_t slave_count;
+
+static uint8_t twi_hang; /* TWI operations never complete, e.g. SCL held low */
+static uint8_t sda_stuck_clocks;
+static uint8_t scl_was_high = 1;
+
+static sim_pin_change_t icp1_change;
+static void *icp1_context;
+static uint8_t icp1_driven_low;
+static uint8_t icp1_pending; /* ICF1, see above */
+static uint64_t icp1_edges[SIM_MAX_ICP1_EDGES]; /* Scheduled falling edges, in time order */
+static uint8_t icp1_edge_head, icp1_edge_count;
+
+static void call_isr(void (*vector)(void))
+{
+    sim_reg_SREG &= ~0x80; /* I flag is cleared on interrupt entry */
+    interrupts_taken++;
+    vector();
+    sim_reg_SREG |= 0x80; /* reti */
+    return;
+}
+
+static uint64_t twi_bit_ns(void)
+{
+    static const uint8_t prescaler[4] = {1, 4, 16, 64};
+    uint32_t cycles = 16 + 2 * (uint32_t)sim_reg_TWBR * prescaler[sim_reg_TWSR & 3];
+
+    return (uint64_t)cycles * 1000000000ULL / F_CPU;
+}
+
+static sim_i2c_slave_t *find_slave(uint8_t address)
+{
+    uint8_t i;
+
+    for (i = 0; i < slave_count; i++)
+    {
+        if (slaves[i].address == address) return &slaves[i];
+    }
+    return NULL;
+}
+
+static void twi_hw_interrupt(uint8_t status)
+{
+    sim_reg_TWSR = (sim_reg_TWSR & 3) | status;
+    sim_reg_TWCR |= (1 << TWINT) | TWCR_HW_TWINT;
+    return;
+}
+
+static void twi_complete_operation(void)
+{
+    uint8_t data;
+
+    switch (twi_operation)
+    {
+        case TWI_START:
+            twi_hw_interrupt(twi_bus_owned ? 0x10 : 0x08);
+            twi_bus_owned = 1;
+            twi_address_phase = 1;
+            break;
+
+        case TWI_BYTE:
+            data = sim_reg_TWDR;
+            if (twi_address_phase)
+            {
+                twi_address_phase = 0;
+                twi_slave = ((data & 1) == 0) ? find_slave(data >> 1) : NULL;
+                if ((twi_slave != NULL) && (twi_slave->max_rate != 0) && (1000000000ULL / twi_bit_ns() > twi_slave->max_rate))
+                {
+                    /* Too fast for this slave, it does not recognise its address */
+                    twi_slave = NULL;
+                }
+                if (twi_slave == NULL) twi_stats.nacks++;
+                twi_hw_interrupt(twi_slave ? 0x18 : 0x20);
+            }
+            else if (twi_slave != NULL)
+            {
+                twi_slave->write(twi_slave->context, data, now_ns);
+                twi_hw_interrupt(0x28);
+            }
+            else
+            {
+                twi_stats.nacks++;
+                twi_hw_interrupt(0x30);
+            }
+            break;
+
+        case TWI_STOP:
+            twi_bus_owned = 0;
+            twi_slave = NULL;
+            sim_reg_TWCR &= ~(1 << TWSTO);
+            break;
+
+        default:
+            break;
+    }
+    twi_operation = TWI_IDLE;
+    return;
+}
+
+/*
+ * Software has written sim_reg_TWCR with TWINT set: start the requested operation.
+ *
+ */
+static void twi_accept_command(void)
+{
+    uint8_t control = sim_reg_TWCR;
+    uint64_t duration;
+
+    if (!(control & (1 << TWEN)) || !(control & (1 << TWINT)) || (control & TWCR_HW_TWINT))
+    {
+        return;
+    }
+    if (control & (1 << TWSTO))
+    {
+        twi_operation = TWI_STOP;
+        twi_stats.stops++;
+        duration = twi_bit_ns();
+    }
+    else if (control & (1 << TWSTA))
+    {
+        twi_operation = TWI_START;
+        twi_stats.starts++;
+        duration = twi_bit_ns();
+    }
+    else
+    {
+        twi_operation = TWI_BYTE;
+        twi_stats.bytes++;
+        duration = 9 * twi_bit_ns();
+    }
+    sim_reg_TWCR = control & ~(1 << TWINT); /* Flag stays cleared while operation is ongoing */
+    twi_done_ns = twi_hang ? UINT64_MAX : now_ns + duration;
+    twi_stats.bus_ns += duration;
+    return;
+}
+
+static void timer1_advance(void)
+{
+    static const uint16_t prescaler[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+    uint16_t divider = prescaler[sim_reg_TCCR1B & 7];
+    uint64_t counts;
+    uint32_t top = sim_reg_OCR1A;
+
+    if (divider == 0)
+    {
+        return;
+    }
+    timer1_remainder += (uint64_t)SIM_STEP_NS * F_CPU;
+    counts = timer1_remainder / (1000000000ULL * divider);
+    timer1_remainder -= counts * 1000000000ULL * divider;
+    while (counts > 0)
+    {
+        if (sim_reg_TCNT1 >= top)
+        {
+            sim_reg_TCNT1 = 0;
+            sim_reg_TIFR1 |= (1 << OCF1A);
+        }
+        else
+        {
+            sim_reg_TCNT1 = sim_reg_TCNT1 + 1;
+        }
+        counts--;
+    }
+    return;
+}
+
+static void pins_update(void)
+{
+    uint8_t scl_high = !(sim_reg_DDRC & (1 << PC5));
+
+    if (!(sim_reg_TWCR & (1 << TWEN)) && (twi_operation != TWI_IDLE))
+    {
+        twi_operation = TWI_IDLE;
+        twi_bus_owned = 0;
+        twi_slave = NULL;
+    }
+    if (scl_high && !scl_was_high && (sda_stuck_clocks > 0))
+    {
+        sda_stuck_clocks--;
+    }
+    scl_was_high = scl_high;
+    sim_reg_PINC = (scl_high ? (1 << PC5) : 0);
+    if (!(sim_reg_DDRC & (1 << PC4)) && (sda_stuck_clocks == 0))
+    {
+        sim_reg_PINC |= (1 << PC4);
+    }
+    return;
+}
+
+static void icp1_update(void)
+{
+    uint8_t driven_low = (sim_reg_DDRB & (1 << PB0)) && !(sim_reg_PORTB & (1 << PB0));
+
+    if (driven_low != icp1_driven_low)
+    {
+        icp1_driven_low = driven_low;
+        if (icp1_change != NULL)
+        {
+            icp1_change(icp1_context, driven_low, now_ns);
+        }
+    }
+    while ((icp1_edge_count > 0) && (icp1_edges[icp1_edge_head] <= now_ns))
+    {
+        if (sim_reg_TIMSK1 & (1 << ICIE1))
+        {
+            sim_reg_ICR1 = sim_reg_TCNT1;
+            icp1_pending = 1;
+        }
+        icp1_edge_head = (icp1_edge_head + 1) % SIM_MAX_ICP1_EDGES;
+        icp1_edge_count--;
+    }
+    sim_reg_TIFR1 = (sim_reg_TIFR1 & ~(1 << ICF1)) | (icp1_pending << ICF1);
+    return;
+}
+
+/*
+ * Advance simulated time by one step: update peripherals, and take pending interrupts if I flag is set.
+ *
+ */
+static void sim_step(void)
+{
+    if (!running || in_step)
+    {
+        return;
+    }
+    in_step = 1;
+    now_ns += SIM_STEP_NS;
+    timer1_advance();
+    pins_update();
+    icp1_update();
+    if ((twi_operation != TWI_IDLE) && (now_ns >= twi_done_ns))
+    {
+        twi_complete_operation();
+    }
+    if (twi_operation == TWI_IDLE)
+    {
+        twi_accept_command();
+    }
+
+    if (sim_reg_SREG & 0x80)
+    {
+        /* In vector order */
+        if (icp1_pending && (sim_reg_TIMSK1 & (1 << ICIE1)) && (TIMER1_CAPT_vect != NULL))
+        {
+            icp1_pending = 0;
+            sim_reg_TIFR1 &= ~(1 << ICF1);
+            call_isr(TIMER1_CAPT_vect);
+        }
+        if ((sim_reg_TIFR1 & (1 << OCF1A)) && (sim_reg_TIMSK1 & (1 << OCIE1A)))
+        {
+            sim_reg_TIFR1 &= ~(1 << OCF1A);
+            call_isr(TIMER1_COMPA_vect);
+        }
+        if ((sim_reg_TWCR & TWCR_HW_TWINT) && (sim_reg_TWCR & (1 << TWIE)))
+        {
+            call_isr(TWI_vect);
+            if (sim_reg_TWCR & TWCR_HW_TWINT)
+            {
+                /* Handler did not clear TWINT, target would re-enter it immediately */
+                twi_stats.isr_retriggers++;
+            }
+            else if (twi_operation == TWI_IDLE)
+            {
+                /* Accept the handler's command before application code can overwrite TWCR */
+                twi_accept_command();
+            }
+        }
+    }
+    in_step = 0;
+    return;
+}
+
+volatile uint8_t *sim_io8(volatile uint8_t *reg)
+{
+    sim_step();
+    return reg;
+}
+
+volatile uint16_t *sim_io16(volatile uint16_t *reg)
+{
+    sim_step();
+    return reg;
+}
+
+/*
+ * Application sources are compiled with -finstrument-functions, so each function call also takes
+ * simulated time. This keeps polling loops which only look at variables updated by interrupt handlers going.
+ *
+ */
+void __cyg_profile_func_enter(void *function, void *call_site)
+{
+    (void)function;
+    (void)call_site;
+    sim_step();
+    return;
+}
+
+void __cyg_profile_func_exit(void *function, void *call_site)
+{
+    (void)function;
+    (void)call_site;
+    return;
+}
+
+void sim_start(void)
+{
+    running = 1;
+    return;
+}
+
+void sim_stop(void)
+{
+    running = 0;
+    return;
+}
+
+uint64_t sim_time_ns(void)
+{
+    return now_ns;
+}
+
+void sim_add_i2c_slave(uint8_t address, sim_i2c_slave_write_t write, void *context)
+{
+    if (slave_count < SIM_MAX_I2C_SLAVES)
+    {
+        slaves[slave_count].address = address;
+        slaves[slave_count].write = write;
+        slaves[slave_count].context = context;
+        slaves[slave_count].max_rate = 0;
+        slave_count++;
+    }
+    return;
+}
+
+void sim_set_i2c_slave_max_rate(uint8_t address, uint32_t max_rate)
+{
+    sim_i2c_slave_t *slave = find_slave(address);
+
+    if (slave != NULL)
+    {
+        slave->max_rate = max_rate;
+    }
+    return;
+}
+
+/*
+ * Fault injection: hang makes TWI operations started from now on never complete, and stuck_sda_clocks
+ * makes SDA stay low until that many SCL clocks have been given by bus recovery.
+ *
+ */
+void sim_set_twi_fault(uint8_t hang, uint8_t stuck_sda_clocks)
+{
+    twi_hang = hang;
+    sda_stuck_clocks = stuck_sda_clocks;
+    return;
+}
+
+void sim_attach_icp1(sim_pin_change_t change, void *context)
+{
+    icp1_change = change;
+    icp1_context = context;
+    return;
+}
+
+/*
+ * Schedule a falling edge on ICP1. Edges must be scheduled in time order.
+ *
+ */
+void sim_icp1_falling_edge(uint64_t time_ns)
+{
+    if (icp1_edge_count < SIM_MAX_ICP1_EDGES)
+    {
+        icp1_edges[(icp1_edge_head + icp1_edge_count) % SIM_MAX_ICP1_EDGES] = time_ns;
+        icp1_edge_count++;
+    }
+    return;
+}
+
+void sim_get_twi_stats(sim_twi_stats_t *stats)
+{
+    *stats = twi_stats;
+    return;
+}
+
+void sim_enable_interrupts(void)
+{
+    sim_reg_SREG |= 0x80;
+    return;
+}
+
+void sim_disable_interrupts(void)
+{
+    sim_reg_SREG &= ~0x80;
+    return;
+}
+
+uint8_t sim_save_interrupts(void)
+{
+    uint8_t saved = sim_reg_SREG;
+
+    sim_reg_SREG &= ~0x80;
+    return saved;
+}
+
+void sim_restore_interrupts(uint8_t saved_sreg, uint8_t type)
+{
+    if (type)
+    {
+        /* ATOMIC_FORCEON */
+        sim_reg_SREG |= 0x80;
+    }
+    else
+    {
+        sim_reg_SREG = saved_sreg;
+    }
+    return;
+}
+
+/*
+ * Sleep until an interrupt has been taken.
+ *
+ */
+void sim_sleep(void)
+{
+    uint32_t taken = interrupts_taken;
+
+    while (running && (interrupts_taken == taken))
+    {
+        sim_step();
+    }
+    return;
+}
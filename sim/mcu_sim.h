@@ -0,0 +1,61 @@
+/*
+ * mcu_sim.h
+ *
+ * Host simulation of the ATmega328P peripherals used by the display and sensor paths: timer1 (systick, delays
+ * and input capture) and TWI master. Application sources are compiled unchanged against the replacement AVR headers
+ * in this directory.
+ *
+ * Simulation is single threaded and deterministic: simulated time advances in SIM_STEP_NS steps when
+ * application code touches a register or calls a function. Each step updates the peripherals and calls
+ * interrupt handlers when the simulated I flag in SREG is set, so interrupts are taken between
+ * application code accesses, as on target.
+ */
+
+
+#ifndef MCU_SIM_H_
+#define MCU_SIM_H_
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+#define SIM_STEP_NS 250 /* About four CPU cycles */
+#define SIM_MAX_I2C_SLAVES 4
+#define SIM_MAX_ICP1_EDGES 128
+
+/* Bus statistics, times in nanoseconds of simulated time */
+typedef struct
+{
+    uint32_t starts; /* Including repeated STARTs */
+    uint32_t stops;
+    uint32_t bytes; /* Address and data bytes */
+    uint32_t nacks;
+    uint32_t isr_retriggers; /* TWI_vect returned without clearing TWINT */
+    uint64_t bus_ns; /* Time the bus has been driven */
+} sim_twi_stats_t;
+
+/* Called when MCU starts (low = 1) or stops driving the input capture pin low */
+typedef void (*sim_pin_change_t)(void *context, uint8_t low, uint64_t time_ns);
+
+/* Called for every data byte acknowledged by a simulated slave, at the time slave latches it */
+typedef void (*sim_i2c_slave_write_t)(void *context, uint8_t data, uint64_t time_ns);
+
+void sim_start(void);
+void sim_stop(void);
+uint64_t sim_time_ns(void);
+void sim_add_i2c_slave(uint8_t address, sim_i2c_slave_write_t write, void *context);
+void sim_set_i2c_slave_max_rate(uint8_t address, uint32_t max_rate);
+void sim_set_twi_fault(uint8_t hang, uint8_t stuck_sda_clocks);
+void sim_get_twi_stats(sim_twi_stats_t *stats);
+void sim_attach_icp1(sim_pin_change_t change, void *context);
+void sim_icp1_falling_edge(uint64_t time_ns);
+
+void sim_enable_interrupts(void);
+void sim_disable_interrupts(void);
+uint8_t sim_save_interrupts(void);
+void sim_restore_interrupts(uint8_t saved_sreg, uint8_t type);
+void sim_sleep(void);
+
+#endif /* MCU_SIM_H_ */
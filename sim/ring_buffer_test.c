@@ -0,0 +1,280 @@
+/*
+ * ring_buffer_test.c
+ *
+ * Host test of ring_buffer.c. Boundary cases are checked first, then both sides are stressed with the other
+ * side running in a signal handler, which interrupts at arbitrary points just like an ISR on target:
+ * - ISR producer, main program consumer (capture_events)
+ * - main program producer, ISR consumer (UART transmit buffer)
+ *
+ * Records have lengths 1-7 bytes, so they straddle the end of the storage and the 8-bit index wrap. Each byte
+ * depends on record sequence number and its position, so a record read before all of it was written, or
+ * overwritten before it was read, shows up as a wrong byte.
+ *
+ * Build and run in sim directory: make ring_buffer_test && ./ring_buffer_test
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include <avr/io.h>
+#include "ring_buffer.h"
+
+#define STRESS_RECORDS 200000UL
+#define STRESS_INTERVAL_US 20
+#define RECORD_MAX_LENGTH 7
+
+RING_BUFFER_DEFINE(small_ring, 8);
+RING_BUFFER_DEFINE(stress_ring, 32);
+RING_BUFFER_DEFINE(max_ring, 128);
+
+uint32_t failures = 0;
+
+volatile uint32_t handler_sequence; /* Next record of the signal handler side */
+volatile uint32_t handler_errors;
+volatile uint8_t handler_producing; /* Which side runs in signal handler */
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+uint8_t record_length(uint32_t sequence)
+{
+    return 1 + (sequence % RECORD_MAX_LENGTH);
+}
+
+uint8_t record_byte(uint32_t sequence, uint8_t position)
+{
+    return (uint8_t)(sequence * 31 + position * 7 + (sequence >> 8));
+}
+
+void make_record(uint32_t sequence, uint8_t *record)
+{
+    uint8_t i;
+
+    for (i = 0; i < record_length(sequence); i++)
+    {
+        record[i] = record_byte(sequence, i);
+    }
+    return;
+}
+
+uint8_t record_valid(uint32_t sequence, const uint8_t *record)
+{
+    uint8_t i;
+
+    for (i = 0; i < record_length(sequence); i++)
+    {
+        if (record[i] != record_byte(sequence, i)) return 0;
+    }
+    return 1;
+}
+
+void test_boundaries(void)
+{
+    uint8_t data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t out[8];
+    uint8_t i, value;
+
+    /* Empty */
+    CHECK(ring_buffer_count(&small_ring) == 0);
+    CHECK(ring_buffer_free(&small_ring) == 8);
+    CHECK(ring_buffer_get(&small_ring, &value) == 0);
+    CHECK(ring_buffer_read(&small_ring, out, 1) == 0);
+
+    /* Fill byte by byte up to full, one more is rejected */
+    for (i = 0; i < 8; i++)
+    {
+        CHECK(ring_buffer_put(&small_ring, data[i]) == 1);
+    }
+    CHECK(ring_buffer_count(&small_ring) == 8);
+    CHECK(ring_buffer_free(&small_ring) == 0);
+    CHECK(ring_buffer_put(&small_ring, 0xee) == 0);
+    CHECK(ring_buffer_write(&small_ring, data, 1) == 0);
+
+    /* Reading more than there is reads nothing */
+    CHECK(ring_buffer_read(&small_ring, out, 3) == 1);
+    CHECK(memcmp(out, data, 3) == 0);
+    CHECK(ring_buffer_read(&small_ring, out, 6) == 0);
+    CHECK(ring_buffer_count(&small_ring) == 5);
+
+    /* Record which does not fit is not written at all, one which fits exactly is */
+    CHECK(ring_buffer_write(&small_ring, data, 4) == 0);
+    CHECK(ring_buffer_count(&small_ring) == 5);
+    CHECK(ring_buffer_write(&small_ring, data, 3) == 1);
+    CHECK(ring_buffer_free(&small_ring) == 0);
+    CHECK(ring_buffer_read(&small_ring, out, 8) == 1);
+    CHECK((memcmp(out, &data[3], 5) == 0) && (memcmp(&out[5], data, 3) == 0));
+    CHECK(ring_buffer_get(&small_ring, &value) == 0);
+
+    /* Zero length */
+    CHECK(ring_buffer_write(&small_ring, data, 0) == 1);
+    CHECK(ring_buffer_read(&small_ring, out, 0) == 1);
+    CHECK(ring_buffer_count(&small_ring) == 0);
+
+    /* Discard empties the buffer, also when indices are about to wrap */
+    small_ring.head = 0xfe;
+    small_ring.tail = 0xfe;
+    CHECK(ring_buffer_write(&small_ring, data, 5) == 1);
+    CHECK(small_ring.head == 0x03);
+    CHECK(ring_buffer_count(&small_ring) == 5);
+    CHECK(ring_buffer_free(&small_ring) == 3);
+    ring_buffer_discard(&small_ring);
+    CHECK(ring_buffer_count(&small_ring) == 0);
+    CHECK(ring_buffer_get(&small_ring, &value) == 0);
+    CHECK(ring_buffer_write(&small_ring, data, 8) == 1);
+    CHECK(ring_buffer_read(&small_ring, out, 8) == 1);
+    CHECK(memcmp(out, data, 8) == 0);
+
+    /* Largest buffer: full is 128 bytes, which is half of the index range */
+    max_ring.head = 0xf0;
+    max_ring.tail = 0xf0;
+    for (i = 0; i < 128; i++)
+    {
+        CHECK(ring_buffer_put(&max_ring, i) == 1);
+    }
+    CHECK(ring_buffer_count(&max_ring) == 128);
+    CHECK(ring_buffer_free(&max_ring) == 0);
+    CHECK(ring_buffer_put(&max_ring, 0) == 0);
+    for (i = 0; i < 128; i++)
+    {
+        CHECK((ring_buffer_get(&max_ring, &value) == 1) && (value == i));
+    }
+    CHECK(ring_buffer_count(&max_ring) == 0);
+    return;
+}
+
+/*
+ * Signal handler is the ISR side: it writes or reads as many records as it can.
+ *
+ */
+void stress_handler(int signal)
+{
+    uint8_t record[RECORD_MAX_LENGTH];
+    uint32_t sequence = handler_sequence;
+
+    (void)signal;
+    if (handler_producing)
+    {
+        while (sequence < STRESS_RECORDS)
+        {
+            make_record(sequence, record);
+            if (!ring_buffer_write(&stress_ring, record, record_length(sequence))) break;
+            sequence++;
+        }
+    }
+    else
+    {
+        while (sequence < STRESS_RECORDS)
+        {
+            if (!ring_buffer_read(&stress_ring, record, record_length(sequence))) break;
+            if (!record_valid(sequence, record)) handler_errors++;
+            sequence++;
+        }
+    }
+    handler_sequence = sequence;
+    return;
+}
+
+void start_interrupts(void)
+{
+    struct itimerval interval = {{0, STRESS_INTERVAL_US}, {0, STRESS_INTERVAL_US}};
+
+    signal(SIGALRM, stress_handler);
+    setitimer(ITIMER_REAL, &interval, NULL);
+    return;
+}
+
+void stop_interrupts(void)
+{
+    struct itimerval interval = {{0, 0}, {0, 0}};
+
+    setitimer(ITIMER_REAL, &interval, NULL);
+    signal(SIGALRM, SIG_DFL);
+    return;
+}
+
+/*
+ * Producer in signal handler, main program consumes. Main program also polls for one byte at a time
+ * between records, so single byte and record functions are mixed.
+ *
+ */
+void test_isr_producer(void)
+{
+    uint8_t record[RECORD_MAX_LENGTH];
+    uint32_t sequence = 0, errors = 0, empty_polls = 0;
+
+    ring_buffer_discard(&stress_ring);
+    handler_sequence = 0;
+    handler_producing = 1;
+    start_interrupts();
+    while (sequence < STRESS_RECORDS)
+    {
+        if ((sequence & 1) && (record_length(sequence) > 1))
+        {
+            /* Record read in two parts: first byte alone, rest as a record */
+            if (ring_buffer_count(&stress_ring) < record_length(sequence))
+            {
+                empty_polls++;
+                continue;
+            }
+            if (!ring_buffer_get(&stress_ring, &record[0])) errors++;
+            if (!ring_buffer_read(&stress_ring, &record[1], record_length(sequence) - 1)) errors++;
+        }
+        else if (!ring_buffer_read(&stress_ring, record, record_length(sequence)))
+        {
+            empty_polls++;
+            continue;
+        }
+        if (!record_valid(sequence, record)) errors++;
+        sequence++;
+    }
+    stop_interrupts();
+    printf("ISR producer: %lu records, %lu empty polls, %lu errors\n", (unsigned long)sequence,
+           (unsigned long)empty_polls, (unsigned long)errors);
+    CHECK(errors == 0);
+    CHECK(ring_buffer_count(&stress_ring) == 0);
+    return;
+}
+
+/*
+ * Main program produces, signal handler consumes.
+ *
+ */
+void test_isr_consumer(void)
+{
+    uint8_t record[RECORD_MAX_LENGTH];
+    uint32_t sequence = 0, full_polls = 0;
+
+    ring_buffer_discard(&stress_ring);
+    handler_sequence = 0;
+    handler_errors = 0;
+    handler_producing = 0;
+    start_interrupts();
+    while (sequence < STRESS_RECORDS)
+    {
+        make_record(sequence, record);
+        if (!ring_buffer_write(&stress_ring, record, record_length(sequence)))
+        {
+            full_polls++;
+            continue;
+        }
+        sequence++;
+    }
+    while (handler_sequence < STRESS_RECORDS);
+    stop_interrupts();
+    printf("ISR consumer: %lu records, %lu full polls, %lu errors\n", (unsigned long)handler_sequence,
+           (unsigned long)full_polls, (unsigned long)handler_errors);
+    CHECK(handler_errors == 0);
+    CHECK(ring_buffer_count(&stress_ring) == 0);
+    return;
+}
+
+int main(void)
+{
+    test_boundaries();
+    test_isr_producer();
+    test_isr_consumer();
+    printf("%s: %lu failures\n", (failures == 0) ? "PASS" : "FAIL", (unsigned long)failures);
+    return (failures == 0) ? 0 : 1;
+}
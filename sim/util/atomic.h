@@ -0,0 +1,22 @@
+/*
+ * atomic.h
+ *
+ * Host simulation replacement of <util/atomic.h>. Interrupts are held off by clearing the simulated I flag,
+ * exactly as on target.
+ */
+
+
+#ifndef SIM_UTIL_ATOMIC_H_
+#define SIM_UTIL_ATOMIC_H_
+
+#include "mcu_sim.h"
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+
+#define ATOMIC_BLOCK(type) \
+    for (uint8_t sim_saved_sreg = sim_save_interrupts(), sim_atomic_once = 1; \
+         sim_atomic_once; \
+         sim_restore_interrupts(sim_saved_sreg, type), sim_atomic_once = 0)
+
+#endif /* SIM_UTIL_ATOMIC_H_ */
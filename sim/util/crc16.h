@@ -0,0 +1,32 @@
+/*
+ * crc16.h
+ *
+ * Host simulation replacement of <util/crc16.h>, equivalent C code of the avr-libc inline assembly.
+ */
+
+
+#ifndef SIM_UTIL_CRC16_H_
+#define SIM_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+    uint8_t i;
+
+    crc ^= a;
+    for (i = 0; i < 8; i++)
+    {
+        if (crc & 1)
+        {
+            crc = (crc >> 1) ^ 0xA001;
+        }
+        else
+        {
+            crc = (crc >> 1);
+        }
+    }
+    return crc;
+}
+
+#endif /* SIM_UTIL_CRC16_H_ */
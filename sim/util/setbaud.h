@@ -0,0 +1,17 @@
+/*
+ * setbaud.h
+ *
+ * Host simulation replacement of <util/setbaud.h>. UART is not simulated, so only the normal speed divider
+ * is calculated from F_CPU and BAUD.
+ */
+
+
+#ifndef SIM_UTIL_SETBAUD_H_
+#define SIM_UTIL_SETBAUD_H_
+
+#define UBRR_VALUE (((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define UBRRH_VALUE (UBRR_VALUE >> 8)
+#define UBRRL_VALUE (UBRR_VALUE & 0xff)
+#define USE_2X 0
+
+#endif /* SIM_UTIL_SETBAUD_H_ */
@@ -7,6 +7,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
+#include <util/atomic.h>
 #include "timer.h"
 
 
@@ -37,11 +38,54 @@ uint32_t get_system_clock(void)
     return system_clock;
 }
 
+/*
+ * Time since init_timer() in microseconds, wraps around after about 71 minutes.
+ * If timer has just cleared but systick interrupt is still pending, the tick is counted here.
+ *
+ */
+uint32_t get_microseconds(void)
+{
+    uint32_t clock;
+    uint16_t counter_value;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        clock = system_clock;
+        counter_value = TCNT1;
+        if ((TIFR1 & (1 << OCF1A)) && (counter_value < (OCR_LIMIT / 2)))
+        {
+            clock++;
+        }
+    }
+    return (clock * 10000) + (counter_value / 2);
+}
+
+/*
+ * Check if a deadline given by get_microseconds() has been reached. Comparison is done as a signed
+ * difference, so it works across wrap-around for deadlines less than 35 minutes away.
+ *
+ */
+uint8_t timer_expired(uint32_t deadline)
+{
+    return ((int32_t)(get_microseconds() - deadline) >= 0);
+}
+
 void configure_sleep_mode()
 {
     set_sleep_mode(SLEEP_MODE_IDLE);
 }
 
+/*
+ * Sleep until next interrupt. Systick wakes CPU up at least every 10ms, so this can be used in
+ * polling loops which have millisecond scale deadlines.
+ *
+ */
+void wait_for_interrupt(void)
+{
+    sleep_mode();
+    return;
+}
+
 void delay_seconds(uint32_t delay_value)
 {
     uint32_t expiration_time, current_system_clock;
@@ -66,34 +110,42 @@ void delay_seconds(uint32_t delay_value)
     return;
 }
 
+/*
+ * Busy wait for given time. Timer1 counts with 0,5us resolution and wraps back to zero at OCR_LIMIT (CTC mode),
+ * so elapsed time is accumulated from consecutive counter readings. Interrupts may occur during the loop,
+ * this is fine as long as one of them does not take a whole timer period (10ms).
+ *
+ */
 void delay_microseconds(uint16_t delay_value)
 {
-    uint16_t expiration_time, counter_value, expiration_time_upper_limit;
-    counter_value = TCNT1;
-    expiration_time = counter_value + 2*delay_value;
-    expiration_time_upper_limit = expiration_time + 50; /* Hat constant :) */
-    
-    /* Because interrupts may occur during busy loop, it is possible that timer counter */
-    /* seems to increment more than one in consecutive checking, there must be enough */
-    /* "overtime window" to allow busy loop terminated */
-    
-    if (expiration_time_upper_limit > expiration_time)
+    uint16_t previous_value, counter_value;
+    uint32_t elapsed = 0, expiration_time;
+
+    expiration_time = 2 * (uint32_t)delay_value;
+    previous_value = TCNT1;
+    while (elapsed < expiration_time)
     {
-        /* Normal "unwrapped" situation */
-        /* Timer is expired, when TCNT1 is within "time - time+50" */
-        while(1)
+        counter_value = TCNT1;
+        if (counter_value >= previous_value)
         {
-            if ((TCNT1 >= expiration_time) && (TCNT1 < expiration_time_upper_limit)) break;
+            elapsed += counter_value - previous_value;
         }
-    }
-    else
-    {
-        /* Wrapped situation */
-        /* Timer is expired, when TCNT1 is outside of "time+50 - time" */
-        while(1)
+        else
         {
-            if ((TCNT1 < expiration_time_upper_limit) || (TCNT1 >= expiration_time_upper_limit)) break;
+            /* Timer has wrapped */
+            elapsed += (OCR_LIMIT - previous_value) + counter_value;
         }
+        previous_value = counter_value;
+    }
+    return;
+}
+
+void delay_milliseconds(uint16_t delay_value)
+{
+    while (delay_value > 0)
+    {
+        delay_microseconds(1000);
+        delay_value--;
     }
     return;
 }
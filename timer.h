@@ -13,6 +13,10 @@
 void init_timer(void);
 void delay_seconds(uint32_t delay_value);
 void delay_microseconds(uint16_t delay_value);
+void delay_milliseconds(uint16_t delay_value);
 uint32_t get_system_clock(void);
+uint32_t get_microseconds(void);
+uint8_t timer_expired(uint32_t deadline);
+void wait_for_interrupt(void);
 
 #endif /* TIMER_H_ */
\ No newline at end of file
@@ -0,0 +1,95 @@
+/*
+ * uart.c
+ *
+ *
+ * Interrupt driven USART0 driver for the query protocol.
+ *
+ * Received bytes are passed to the query protocol directly from RX ISR. Bytes to be transmitted are copied into
+ * a ring buffer, which is emptied one byte per "data register empty" interrupt, so main program is never blocked
+ * and caller may reuse its buffer immediately.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "uart.h"
+#include "query.h"
+#include "ring_buffer.h"
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+#define BAUD UART_BAUD
+#include <util/setbaud.h>
+
+RING_BUFFER_DEFINE(tx_buffer, UART_TX_BUFFER_SIZE);
+
+/* 8 data bits, no parity, 1 stop bit */
+void init_uart(void)
+{
+    UBRR0H = UBRRH_VALUE;
+    UBRR0L = UBRRL_VALUE;
+#if USE_2X
+    UCSR0A |= (1 << U2X0);
+#else
+    UCSR0A &= ~(1 << U2X0);
+#endif
+    UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+    UCSR0B = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
+    return;
+}
+
+/*
+ * Queue a frame for transmission. Frame is queued completely or not at all, returns zero if there was not room.
+ *
+ * This is called from RX ISR when a valid request has been received, so interrupts are already disabled.
+ * From main program call this inside an atomic block.
+ *
+ */
+uint8_t uart_start_transmit(const uint8_t *data, uint8_t length)
+{
+    if (!ring_buffer_write(&tx_buffer, data, length))
+    {
+        return 0;
+    }
+    if (length > 0)
+    {
+        UCSR0B |= (1 << UDRIE0);
+    }
+    return 1;
+}
+
+uint8_t uart_transmit_busy(void)
+{
+    return (ring_buffer_count(&tx_buffer) > 0);
+}
+
+/*
+ * Byte received. Framing and overrun errors are passed to protocol, because they break the frame being received.
+ *
+ */
+ISR(USART_RX_vect)
+{
+    uint8_t status, data;
+
+    status = UCSR0A; /* Status must be read before data */
+    data = UDR0;
+    query_receive_byte(data, status & ((1 << FE0) | (1 << DOR0)));
+    return;
+}
+
+ISR(USART_UDRE_vect)
+{
+    uint8_t data;
+
+    if (ring_buffer_get(&tx_buffer, &data))
+    {
+        UDR0 = data;
+    }
+    if (ring_buffer_count(&tx_buffer) == 0)
+    {
+        /* Last byte is in transmitter, no more "register empty" interrupts needed */
+        UCSR0B &= ~(1 << UDRIE0);
+    }
+    return;
+}
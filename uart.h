@@ -0,0 +1,21 @@
+/*
+ * uart.h
+ *
+ *
+ */
+
+
+#ifndef UART_H_
+#define UART_H_
+
+#ifndef UART_BAUD
+#define UART_BAUD 38400
+#endif
+
+#define UART_TX_BUFFER_SIZE 32
+
+void init_uart(void);
+uint8_t uart_start_transmit(const uint8_t *data, uint8_t length);
+uint8_t uart_transmit_busy(void);
+
+#endif /* UART_H_ */